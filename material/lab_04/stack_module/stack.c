@@ -16,94 +16,990 @@
 #include <linux/device.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/moduleparam.h>
+#include <linux/shmem_fs.h>
+#include <linux/shrinker.h>
+#include <linux/list_lru.h>
+#include <linux/falloc.h>
 
 #include <linux/string.h>
 
-#define MAJOR_NUM   98
-#define MAJMIN	    MKDEV(MAJOR_NUM, 0)
+#include "stack.h"
+
 #define DEVICE_NAME "stack"
 
-struct stack_node {
+// Maximum number of values in a stack
+static unsigned long capacity = 1024 * 1024;
+module_param(capacity, ulong, 0444);
+MODULE_PARM_DESC(capacity, "Maximum number of values in a stack");
+
+// Number of independent stacks, one per minor: /dev/stack, /dev/stack1, ...
+static unsigned int nb_stacks = 1;
+module_param(nb_stacks, uint, 0444);
+MODULE_PARM_DESC(nb_stacks, "Number of stack devices");
+
+// Give each open file its own stack, instead of the one of its minor
+static bool private_stacks;
+module_param(private_stacks, bool, 0444);
+MODULE_PARM_DESC(private_stacks, "Give each open file its own stack");
+
+/*
+ * The stack is stored in page-sized chunks, each holding up to
+ * STACK_CHUNK_VALUES values, the bottom of the chunk first. The chunks are
+ * linked from the top of the stack, so the first chunk of the list holds the
+ * top of the stack in its last used slot.
+ *
+ * The stack may be used by several processes at once. The chunks and the size
+ * are protected by a spinlock, which is only held to move values in and out of
+ * the stack with memcpy() and list splices: the copies from/to the user, which
+ * may fault and sleep, and the allocations are done outside of it, with
+ * private chunks. A write() or a read() is thus atomic: its values are pushed
+ * or popped together, and never interleaved with the ones of another call.
+ *
+ * The stack holds at most 'capacity' values. Readers sleep while it is empty
+ * and writers while it is full, unless the file is non-blocking; a write()
+ * that does not fit pushes what fits and returns a short count.
+ *
+ * The chunks are charged to the memory cgroup of the writer. Under memory
+ * pressure, a shrinker moves the deepest chunks of the stacks to a shmem file
+ * (which, unlike the chunks, can be swapped out), always keeping the
+ * STACK_SPILL_KEEP top chunks resident. The spilled chunks are a stack of
+ * their own, below the resident ones: the deepest resident chunk is spilled
+ * on top of them, and the top spilled chunk is read back when a pop needs it.
+ *
+ * The shrinker is memcg-aware: the resident chunks are also in a list_lru,
+ * which sorts them by the cgroup they are charged to, so that a cgroup
+ * hitting its limit spills the stacks holding its chunks (the reclaim of a
+ * cgroup only calls the memcg-aware shrinkers), not only global pressure.
+ */
+struct stack_chunk {
 	struct list_head list;
-	uint32_t value;
+	// in stack_lru while in a stack, and the stack it is in
+	struct list_head lru;
+	struct stack_data *stack_data;
+	size_t count;
+	uint32_t values[];
 };
 
+#define STACK_CHUNK_SIZE PAGE_SIZE
+#define STACK_CHUNK_VALUES                                       \
+	((STACK_CHUNK_SIZE - offsetof(struct stack_chunk, values)) / \
+	 sizeof(uint32_t))
+
+/*
+ * Each call allocates private chunks and frees the ones emptied: they go
+ * through a small per-CPU magazine of free chunks, so that in steady state
+ * the chunks are recycled on the CPU that uses them, without any lock.
+ */
+#define STACK_MAGAZINE_SIZE 4
+
+struct stack_magazine {
+	unsigned int count;
+	struct stack_chunk *chunks[STACK_MAGAZINE_SIZE];
+};
+
+// Number of chunks (worth of values) never spilled, at the top of a stack
+#define STACK_SPILL_KEEP 4
+
 struct stack_data {
-	struct cdev cdev;
-	struct class *cl;
+	spinlock_t lock;
+	// resident chunks, the top one first
 	struct list_head head;
+	// values in the stack, and in the resident and spilled chunks
 	ssize_t stack_size;
+	ssize_t resident_size;
+	ssize_t spilled_size;
+	ssize_t capacity;
+	// readers waiting for values, writers waiting for room
+	wait_queue_head_t read_queue;
+	wait_queue_head_t write_queue;
+
+	// serializes the moves to and from the spill file
+	struct mutex spill_mutex;
+	// shmem file holding the spilled chunks, created on the first spill
+	struct file *spill;
+	// number of chunks in the spill file, the top one last
+	size_t nr_spilled;
+	// number of chunk slots of the spill file that may still hold pages:
+	// the slots above nr_spilled whose pages could not be released yet
+	size_t spill_end;
+	// in the list of all the stacks, for the shrinker
+	struct list_head node;
+	// chunks the shrinker picked in this stack, to spill (only touched
+	// under stack_list_mutex)
+	unsigned long shrink_picked;
 };
 
-struct device *stack_device;
+// State of an open file: the stack it works on and the shared area
+struct stack_file {
+	struct stack_data *stack_data;
+	// whether stack_data belongs to this file (private_stacks)
+	bool private;
+	struct mutex shm_mutex;
+	uint32_t *shm;
+};
+
+// The device region, minor i working on stacks[i]
+struct stack_driver {
+	dev_t devt;
+	struct cdev cdev;
+	struct class *cl;
+	struct stack_data *stacks;
+};
+
+static struct stack_driver stack_driver;
+
+// Free chunks, shared by all the stacks
+static struct stack_magazine __percpu *stack_magazines;
+static struct kmem_cache *stack_chunk_cache;
+
+// All the stacks (of the minors and private), for the shrinker
+static LIST_HEAD(stack_list);
+static DEFINE_MUTEX(stack_list_mutex);
+
+// Resident chunks of all the stacks, per node and memory cgroup
+static struct list_lru stack_lru;
 
 /**
- * @brief Pop and return latest added element of the stack.
+ * @brief Get an empty chunk, from the magazine of the CPU if possible.
  *
- * @param filp pointer to the file descriptor in use
- * @param buf destination buffer in user space
- * @param count maximum number of byte to read
- * @param ppos ignored
+ * @return An empty chunk, or NULL if no memory is available
+ */
+static struct stack_chunk *stack_chunk_alloc(void)
+{
+	struct stack_magazine *mag;
+	struct stack_chunk *chunk = NULL;
+
+	mag = get_cpu_ptr(stack_magazines);
+	if (mag->count > 0)
+		chunk = mag->chunks[--mag->count];
+	put_cpu_ptr(stack_magazines);
+
+	if (!chunk) {
+		// also sets stack_lru up for the cgroup it is charged to
+		chunk = kmem_cache_alloc_lru(stack_chunk_cache, &stack_lru,
+					     GFP_KERNEL_ACCOUNT);
+		if (!chunk)
+			return NULL;
+	}
+
+	INIT_LIST_HEAD(&chunk->lru);
+	chunk->count = 0;
+	return chunk;
+}
+
+/**
+ * @brief Release a chunk, to the magazine of the CPU if there is room.
  *
- * @return Actual number of bytes read from internal buffer,
- *         or a negative error code
+ * @param chunk the chunk, not in any list
  */
+static void stack_chunk_free(struct stack_chunk *chunk)
+{
+	struct stack_magazine *mag;
 
-static ssize_t stack_read(struct file *filp, char __user *buf, size_t count,
-			  loff_t *ppos)
+	mag = get_cpu_ptr(stack_magazines);
+	if (mag->count < STACK_MAGAZINE_SIZE) {
+		mag->chunks[mag->count++] = chunk;
+		chunk = NULL;
+	}
+	put_cpu_ptr(stack_magazines);
+
+	if (chunk)
+		kmem_cache_free(stack_chunk_cache, chunk);
+}
+
+/**
+ * @brief Show a chunk put on a stack to the shrinker.
+ *
+ * May be called with the lock of the stack held.
+ *
+ * @param stack_data stack the chunk is put on
+ * @param chunk the chunk
+ */
+static void stack_chunk_track(struct stack_data *stack_data,
+			      struct stack_chunk *chunk)
+{
+	chunk->stack_data = stack_data;
+	list_lru_add(&stack_lru, &chunk->lru);
+}
+
+/**
+ * @brief Hide a chunk taken off its stack from the shrinker.
+ *
+ * May be called with the lock of the stack held.
+ *
+ * @param chunk the chunk
+ */
+static void stack_chunk_untrack(struct stack_chunk *chunk)
+{
+	list_lru_del(&stack_lru, &chunk->lru);
+}
+
+/**
+ * @brief Reverse the order of some values, in place.
+ *
+ * @param values first value
+ * @param nb_values number of values
+ */
+static void stack_reverse(uint32_t *values, size_t nb_values)
+{
+	size_t i;
+	uint32_t tmp;
+
+	for (i = 0; i < nb_values / 2; i++) {
+		tmp = values[i];
+		values[i] = values[nb_values - i - 1];
+		values[nb_values - i - 1] = tmp;
+	}
+}
+
+/**
+ * @brief Initialize an empty stack.
+ *
+ * @param stack_data stack to initialize
+ */
+static void stack_data_init(struct stack_data *stack_data)
+{
+	spin_lock_init(&stack_data->lock);
+	INIT_LIST_HEAD(&stack_data->head);
+	stack_data->stack_size = 0;
+	stack_data->resident_size = 0;
+	stack_data->spilled_size = 0;
+	stack_data->capacity = min_t(unsigned long, capacity, SSIZE_MAX);
+	init_waitqueue_head(&stack_data->read_queue);
+	init_waitqueue_head(&stack_data->write_queue);
+
+	mutex_init(&stack_data->spill_mutex);
+	stack_data->spill = NULL;
+	stack_data->nr_spilled = 0;
+	stack_data->spill_end = 0;
+	stack_data->shrink_picked = 0;
+
+	mutex_lock(&stack_list_mutex);
+	list_add(&stack_data->node, &stack_list);
+	mutex_unlock(&stack_list_mutex);
+}
+
+/**
+ * @brief Free the values of a stack no one uses anymore.
+ *
+ * @param stack_data stack to empty
+ */
+static void stack_data_clear(struct stack_data *stack_data)
+{
+	struct stack_chunk *chunk, *tmp;
+
+	mutex_lock(&stack_list_mutex);
+	list_del(&stack_data->node);
+	mutex_unlock(&stack_list_mutex);
+
+	list_for_each_entry_safe(chunk, tmp, &stack_data->head, list) {
+		list_del(&chunk->list);
+		stack_chunk_untrack(chunk);
+		kmem_cache_free(stack_chunk_cache, chunk);
+	}
+	if (stack_data->spill)
+		fput(stack_data->spill);
+	stack_data->stack_size = 0;
+}
+
+/**
+ * @brief Move the deepest resident chunks of a stack to its spill file.
+ *
+ * Called by the shrinker, so it gives up rather than wait for the stack.
+ *
+ * @param stack_data stack to spill
+ * @param nr_chunks maximum number of chunks to spill
+ *
+ * @return Number of chunks spilled (and freed)
+ */
+static unsigned long stack_spill(struct stack_data *stack_data,
+				 unsigned long nr_chunks)
+{
+	struct stack_chunk *chunk;
+	unsigned long done = 0;
+	struct file *spill;
+	ssize_t ret;
+	loff_t pos;
+
+	if (!mutex_trylock(&stack_data->spill_mutex))
+		return 0;
+
+	if (!stack_data->spill) {
+		spill = shmem_file_setup("stack-spill", MAX_LFS_FILESIZE,
+					 VM_NORESERVE);
+		if (IS_ERR(spill))
+			goto unlock;
+		// past 2 GiB on 32-bit targets too
+		spill->f_flags |= O_LARGEFILE;
+		stack_data->spill = spill;
+	}
+
+	while (done < nr_chunks) {
+		spin_lock(&stack_data->lock);
+		if (list_empty(&stack_data->head)) {
+			spin_unlock(&stack_data->lock);
+			break;
+		}
+		chunk = list_last_entry(&stack_data->head, struct stack_chunk,
+					list);
+		if (stack_data->resident_size - (ssize_t)chunk->count <
+		    (ssize_t)(STACK_SPILL_KEEP * STACK_CHUNK_VALUES)) {
+			spin_unlock(&stack_data->lock);
+			break;
+		}
+		// the values are accounted as spilled from now on, a pop that
+		// needs them waits for the mutex, then reads them back
+		list_del(&chunk->list);
+		stack_chunk_untrack(chunk);
+		WRITE_ONCE(stack_data->resident_size,
+			   stack_data->resident_size - chunk->count);
+		WRITE_ONCE(stack_data->spilled_size,
+			   stack_data->spilled_size + chunk->count);
+		spin_unlock(&stack_data->lock);
+
+		pos = (loff_t)stack_data->nr_spilled * STACK_CHUNK_SIZE;
+		ret = kernel_write(stack_data->spill, chunk, STACK_CHUNK_SIZE,
+				   &pos);
+		if (ret != STACK_CHUNK_SIZE) {
+			// put it back where it was
+			spin_lock(&stack_data->lock);
+			list_add_tail(&chunk->list, &stack_data->head);
+			stack_chunk_track(stack_data, chunk);
+			WRITE_ONCE(stack_data->resident_size,
+				   stack_data->resident_size + chunk->count);
+			WRITE_ONCE(stack_data->spilled_size,
+				   stack_data->spilled_size - chunk->count);
+			spin_unlock(&stack_data->lock);
+			break;
+		}
+
+		stack_data->nr_spilled++;
+		if (stack_data->spill_end < stack_data->nr_spilled)
+			WRITE_ONCE(stack_data->spill_end,
+				   stack_data->nr_spilled);
+		// the point is to give the memory back, not to recycle it
+		kmem_cache_free(stack_chunk_cache, chunk);
+		done++;
+	}
+
+unlock:
+	mutex_unlock(&stack_data->spill_mutex);
+	return done;
+}
+
+/**
+ * @brief Read spilled chunks back, until enough values are resident.
+ *
+ * @param stack_data stack to read back
+ * @param wanted number of values that should be resident
+ *
+ * @return 0, or a negative error code
+ */
+static int stack_unspill(struct stack_data *stack_data, ssize_t wanted)
+{
+	struct stack_chunk *chunk;
+	int err = 0;
+	ssize_t ret;
+	loff_t pos;
+	int punch;
+
+	mutex_lock(&stack_data->spill_mutex);
+
+	while (READ_ONCE(stack_data->resident_size) < wanted &&
+	       stack_data->nr_spilled > 0) {
+		chunk = stack_chunk_alloc();
+		if (!chunk) {
+			err = -ENOMEM;
+			break;
+		}
+
+		pos = (loff_t)(stack_data->nr_spilled - 1) * STACK_CHUNK_SIZE;
+		ret = kernel_read(stack_data->spill, chunk, STACK_CHUNK_SIZE,
+				  &pos);
+		if (ret != STACK_CHUNK_SIZE) {
+			pr_err("Stack: Failed to read spilled values back\n");
+			stack_chunk_free(chunk);
+			err = ret < 0 ? ret : -EIO;
+			break;
+		}
+
+		// give the shmem pages back, the chunk is resident again; the
+		// pages of the slots a previous punch failed to release are
+		// retried along
+		stack_data->nr_spilled--;
+		punch = vfs_fallocate(stack_data->spill,
+				      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				      (loff_t)stack_data->nr_spilled *
+					      STACK_CHUNK_SIZE,
+				      (loff_t)(stack_data->spill_end -
+					       stack_data->nr_spilled) *
+					      STACK_CHUNK_SIZE);
+		if (punch)
+			pr_warn_ratelimited("Stack: Failed to release spilled pages (%d)\n",
+					    punch);
+		else
+			WRITE_ONCE(stack_data->spill_end,
+				   stack_data->nr_spilled);
+
+		// the chunks pushed meanwhile are above it
+		spin_lock(&stack_data->lock);
+		list_add_tail(&chunk->list, &stack_data->head);
+		stack_chunk_track(stack_data, chunk);
+		WRITE_ONCE(stack_data->resident_size,
+			   stack_data->resident_size + chunk->count);
+		WRITE_ONCE(stack_data->spilled_size,
+			   stack_data->spilled_size - chunk->count);
+		spin_unlock(&stack_data->lock);
+	}
+
+	mutex_unlock(&stack_data->spill_mutex);
+	return err;
+}
+
+/**
+ * @brief Number of chunks the shrinker could spill.
+ *
+ * Only counts the chunks charged to the node and cgroup being reclaimed. The
+ * STACK_SPILL_KEEP top chunks of each stack are counted too, the scans just
+ * spill less than asked when they are all that is left.
+ *
+ * @param shrinker the stack shrinker
+ * @param sc reclaim context
+ *
+ * @return Number of chunks that could be spilled
+ */
+static unsigned long stack_shrink_count(struct shrinker *shrinker,
+					struct shrink_control *sc)
+{
+	unsigned long count;
+
+	// stack_lru is only set up once the shrinker is registered
+	if (!mutex_trylock(&stack_list_mutex))
+		return 0;
+	count = list_lru_shrink_count(&stack_lru, sc);
+	mutex_unlock(&stack_list_mutex);
+
+	return count;
+}
+
+/**
+ * @brief Pick the stack of a chunk to spill, on a walk of stack_lru.
+ *
+ * Called with the lock of the list, so the chunk is still in its stack, and
+ * with stack_list_mutex, so the stack is still there.
+ *
+ * @param item lru entry of the chunk
+ * @param list list of the chunk (ignored)
+ * @param lock lock of the list (ignored)
+ * @param arg unused
+ *
+ * @return LRU_ROTATE, the chunk stays in its stack until it is spilled
+ */
+static enum lru_status stack_shrink_pick(struct list_head *item,
+					 struct list_lru_one *list,
+					 spinlock_t *lock, void *arg)
+{
+	struct stack_chunk *chunk = container_of(item, struct stack_chunk, lru);
+
+	chunk->stack_data->shrink_picked++;
+	return LRU_ROTATE;
+}
+
+/**
+ * @brief Spill chunks of the stacks, to free memory.
+ *
+ * The stacks holding chunks charged to the node and cgroup being reclaimed
+ * are picked first, then they spill as many chunks as were picked in them.
+ * A stack only spills its deepest chunks, which usually belong to the same
+ * cgroup as the picked ones (the one of its writer).
+ *
+ * @param shrinker the stack shrinker
+ * @param sc reclaim context, with the number of chunks to spill
+ *
+ * @return Number of chunks spilled, or SHRINK_STOP
+ */
+static unsigned long stack_shrink_scan(struct shrinker *shrinker,
+				       struct shrink_control *sc)
 {
 	struct stack_data *stack_data;
-	ssize_t nb_values, i;
-	uint32_t *read_values;
-	struct stack_node *node;
+	unsigned long freed = 0;
+
+	// writing to the spill file may need the file system
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
 
-	// get stack data from the class device contained into the file
-	stack_data =
-		container_of(filp->f_inode->i_cdev, struct stack_data, cdev);
-	if (!stack_data) {
-		pr_err("Stack: Unable to retrieve stack_data\n");
-		return -ENODEV;
+	if (!mutex_trylock(&stack_list_mutex))
+		return SHRINK_STOP;
+
+	list_lru_shrink_walk(&stack_lru, sc, stack_shrink_pick, NULL);
+
+	list_for_each_entry(stack_data, &stack_list, node) {
+		if (stack_data->shrink_picked == 0)
+			continue;
+		freed += stack_spill(stack_data, stack_data->shrink_picked);
+		stack_data->shrink_picked = 0;
 	}
 
-	if (count % sizeof(uint32_t) != 0)
-		return -EINVAL;
+	mutex_unlock(&stack_list_mutex);
+	return freed;
+}
+
+static struct shrinker stack_shrinker = {
+	.count_objects = stack_shrink_count,
+	.scan_objects = stack_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+	.flags = SHRINKER_NUMA_AWARE | SHRINKER_MEMCG_AWARE,
+};
+
+/**
+ * @brief Number of values that can still be pushed.
+ *
+ * May be called without the lock, to know whether to sleep.
+ *
+ * @param stack_data stack to check
+ *
+ * @return Number of free slots
+ */
+static ssize_t stack_room(struct stack_data *stack_data)
+{
+	return stack_data->capacity - READ_ONCE(stack_data->stack_size);
+}
+
+/**
+ * @brief Keep only the first values of a batch, the others are dropped.
+ *
+ * @param batch chunks of the batch, the bottom one first
+ * @param nb_values number of values to keep
+ */
+static void stack_batch_truncate(struct list_head *batch, size_t nb_values)
+{
+	struct stack_chunk *chunk;
+
+	list_for_each_entry(chunk, batch, list) {
+		chunk->count = min(chunk->count, nb_values);
+		nb_values -= chunk->count;
+	}
+}
+
+/**
+ * @brief Push a batch of chunks on the stack, with the lock held.
+ *
+ * The values first fill the free slots of the top chunk, then the chunks of
+ * the batch themselves become the top of the stack, so no allocation is
+ * needed here. The chunks of the batch left in the list are empty.
+ *
+ * @param stack_data stack to push on
+ * @param batch chunks to push, the bottom one first
+ */
+static void stack_push_batch(struct stack_data *stack_data,
+			     struct list_head *batch)
+{
+	struct stack_chunk *chunk, *tmp, *top;
+	size_t n;
 
-	nb_values = count / sizeof(uint32_t);
+	list_for_each_entry_safe(chunk, tmp, batch, list) {
+		top = list_first_entry_or_null(&stack_data->head,
+					       struct stack_chunk, list);
+		n = 0;
+		if (top) {
+			n = min_t(size_t, STACK_CHUNK_VALUES - top->count,
+				  chunk->count);
+			memcpy(&top->values[top->count], chunk->values,
+			       n * sizeof(uint32_t));
+			top->count += n;
+		}
 
-	if (stack_data->stack_size == 0)
+		if (n < chunk->count) {
+			memmove(chunk->values, &chunk->values[n],
+				(chunk->count - n) * sizeof(uint32_t));
+			chunk->count -= n;
+			list_move(&chunk->list, &stack_data->head);
+			stack_chunk_track(stack_data, chunk);
+		} else {
+			chunk->count = 0;
+		}
+	}
+}
+
+/**
+ * @brief Copy values out of a chunk, to the user or to a kernel buffer.
+ *
+ * @param ubuf destination buffer in user space, or NULL
+ * @param kbuf destination buffer in kernel space, used if ubuf is NULL
+ * @param offset index of the first value to write in the destination
+ * @param values values to copy
+ * @param nb_values number of values to copy
+ *
+ * @return 0, or -EFAULT if the copy to the user failed
+ */
+static int stack_copy_out(char __user *ubuf, uint32_t *kbuf, size_t offset,
+			  const uint32_t *values, size_t nb_values)
+{
+	if (!ubuf) {
+		memcpy(kbuf + offset, values, nb_values * sizeof(uint32_t));
+		return 0;
+	}
+
+	if (copy_to_user(ubuf + offset * sizeof(uint32_t), values,
+			 nb_values * sizeof(uint32_t)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+/**
+ * @brief Copy values into a chunk, from the user or from a kernel buffer.
+ *
+ * @param values destination in the chunk
+ * @param ubuf source buffer in user space, or NULL
+ * @param kbuf source buffer in kernel space, used if ubuf is NULL
+ * @param offset index of the first value to read in the source
+ * @param nb_values number of values to copy
+ *
+ * @return 0, or -EFAULT if the copy from the user failed
+ */
+static int stack_copy_in(uint32_t *values, const char __user *ubuf,
+			 const uint32_t *kbuf, size_t offset, size_t nb_values)
+{
+	if (!ubuf) {
+		memcpy(values, kbuf + offset, nb_values * sizeof(uint32_t));
 		return 0;
+	}
+
+	if (copy_from_user(values, ubuf + offset * sizeof(uint32_t),
+			   nb_values * sizeof(uint32_t)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+/**
+ * @brief Pop values from the stack, the latest added first.
+ *
+ * The values are taken from the stack under the lock (whole chunks are
+ * simply moved to a private list), then copied out, a chunk at a time.
+ * If a copy fails, the values popped but not copied are lost, and the values
+ * copied so far are returned.
+ *
+ * Sleeps while the stack is empty, unless 'nonblock' is set.
+ *
+ * @param stack_data stack to pop from
+ * @param ubuf destination buffer in user space, or NULL
+ * @param kbuf destination buffer in kernel space, used if ubuf is NULL
+ * @param nb_values maximum number of values to pop
+ * @param nonblock whether to fail with -EAGAIN instead of sleeping
+ *
+ * @return Number of values popped, or a negative error code
+ */
+static ssize_t stack_pop(struct stack_data *stack_data, char __user *ubuf,
+			 uint32_t *kbuf, ssize_t nb_values, bool nonblock)
+{
+	ssize_t done = 0, copied = 0, wanted;
+	struct stack_chunk *chunk, *tmp, *partial;
+	bool unspilled = false;
+	LIST_HEAD(popped);
+	int err = 0;
+	size_t n;
+
+	if (nb_values == 0)
+		return 0;
+
+	// the last values may be taken from the middle of a chunk, which then
+	// stays on the stack: they are copied into a private chunk
+	partial = stack_chunk_alloc();
+	if (!partial)
+		return -ENOMEM;
+
+retry:
+	spin_lock(&stack_data->lock);
+	while (stack_data->stack_size == 0) {
+		spin_unlock(&stack_data->lock);
+
+		if (nonblock)
+			err = -EAGAIN;
+		else
+			err = wait_event_interruptible(
+				stack_data->read_queue,
+				READ_ONCE(stack_data->stack_size) > 0);
+		if (err) {
+			stack_chunk_free(partial);
+			return err;
+		}
+
+		// another reader may have been faster
+		spin_lock(&stack_data->lock);
+	}
 
 	// check if the stack is smaller than the requested number of values
 	// If so, we should return the actual number of values in the stack
-	if (nb_values > stack_data->stack_size)
-		nb_values = stack_data->stack_size;
+	wanted = min(nb_values, stack_data->stack_size);
 
-	read_values = kmalloc(nb_values * sizeof(uint32_t), GFP_KERNEL);
-	if (!read_values)
-		return -ENOMEM;
+	// read spilled values back if needed: once, unless there is nothing
+	// resident at all (the shrinker may spill them again meanwhile)
+	if (stack_data->resident_size < wanted &&
+	    (!unspilled || stack_data->resident_size == 0)) {
+		spin_unlock(&stack_data->lock);
+		err = stack_unspill(stack_data, wanted);
+		if (err) {
+			stack_chunk_free(partial);
+			return err;
+		}
+		unspilled = true;
+		goto retry;
+	}
+	nb_values = min(wanted, stack_data->resident_size);
 
-	for (i = 0; i < nb_values; i++) {
-		node = list_first_entry(&stack_data->head, struct stack_node,
-					list);
+	while (done < nb_values) {
+		chunk = list_first_entry(&stack_data->head, struct stack_chunk,
+					 list);
+		if (chunk->count <= nb_values - done) {
+			list_move_tail(&chunk->list, &popped);
+			stack_chunk_untrack(chunk);
+			done += chunk->count;
+		} else {
+			n = nb_values - done;
+			chunk->count -= n;
+			memcpy(partial->values, &chunk->values[chunk->count],
+			       n * sizeof(uint32_t));
+			partial->count = n;
+			list_add_tail(&partial->list, &popped);
+			partial = NULL;
+			done += n;
+		}
+	}
+
+	WRITE_ONCE(stack_data->stack_size, stack_data->stack_size - done);
+	WRITE_ONCE(stack_data->resident_size,
+		   stack_data->resident_size - done);
+
+	spin_unlock(&stack_data->lock);
 
-		read_values[i] = node->value;
-		list_del(&node->list);
-		kfree(node);
+	wake_up_interruptible(&stack_data->write_queue);
+
+	if (partial)
+		stack_chunk_free(partial);
+
+	list_for_each_entry_safe(chunk, tmp, &popped, list) {
+		// the top of the stack is the last value of the chunk, but the
+		// first one the user gets
+		if (!err) {
+			stack_reverse(chunk->values, chunk->count);
+			err = stack_copy_out(ubuf, kbuf, copied, chunk->values,
+					     chunk->count);
+			if (err)
+				pr_err("Stack: Failed to copy data to user\n");
+			else
+				copied += chunk->count;
+		}
+
+		list_del(&chunk->list);
+		stack_chunk_free(chunk);
 	}
 
-	stack_data->stack_size -= nb_values;
+	if (copied == 0 && err)
+		return err;
 
-	if (copy_to_user(buf, read_values, nb_values * sizeof(uint32_t)) != 0) {
-		kfree(read_values);
-		pr_err("Stack: Failed to copy data to user\n");
-		return -EFAULT;
+	return copied;
+}
+
+/**
+ * @brief Push values on the stack, the first one first.
+ *
+ * The values are first copied into private chunks, then pushed all at once
+ * under the lock. If a copy or an allocation fails after some values have
+ * been copied, only these values are pushed.
+ *
+ * Sleeps while the stack is full, unless 'nonblock' is set. Only the values
+ * that fit in the stack are pushed.
+ *
+ * @param stack_data stack to push on
+ * @param ubuf source buffer in user space, or NULL
+ * @param kbuf source buffer in kernel space, used if ubuf is NULL
+ * @param wanted number of values to push
+ * @param nonblock whether to fail with -EAGAIN instead of sleeping
+ *
+ * @return Number of values pushed, or a negative error code
+ */
+static ssize_t stack_push(struct stack_data *stack_data,
+			  const char __user *ubuf, const uint32_t *kbuf,
+			  ssize_t wanted, bool nonblock)
+{
+	ssize_t nb_values, done, room;
+	struct stack_chunk *chunk, *tmp;
+	LIST_HEAD(batch);
+	int err;
+	size_t n;
+
+	if (wanted == 0)
+		return 0;
+
+retry:
+	if (stack_room(stack_data) <= 0) {
+		if (nonblock)
+			return -EAGAIN;
+		err = wait_event_interruptible(stack_data->write_queue,
+					       stack_room(stack_data) > 0);
+		if (err)
+			return err;
+	}
+
+	// only copy what fits, the room is checked again under the lock
+	nb_values = min(wanted, stack_room(stack_data));
+	if (nb_values <= 0)
+		goto retry;
+	done = 0;
+	err = 0;
+
+	while (done < nb_values) {
+		chunk = stack_chunk_alloc();
+		if (!chunk) {
+			pr_err("Stack: Failed to allocate memory for stack elements\n");
+			err = -ENOMEM;
+			break;
+		}
+
+		n = min_t(size_t, STACK_CHUNK_VALUES, nb_values - done);
+		if (stack_copy_in(chunk->values, ubuf, kbuf, done, n) != 0) {
+			pr_err("Stack: Failed to copy buffer from user\n");
+			stack_chunk_free(chunk);
+			err = -EFAULT;
+			break;
+		}
+
+		chunk->count = n;
+		list_add_tail(&chunk->list, &batch);
+		done += n;
 	}
 
-	kfree(read_values);
+	if (done == 0)
+		return err;
+
+	spin_lock(&stack_data->lock);
+	// other writers may have filled the stack meanwhile
+	room = stack_data->capacity - stack_data->stack_size;
+	if (done > room) {
+		done = max_t(ssize_t, room, 0);
+		stack_batch_truncate(&batch, done);
+	}
+	stack_push_batch(stack_data, &batch);
+	WRITE_ONCE(stack_data->stack_size, stack_data->stack_size + done);
+	WRITE_ONCE(stack_data->resident_size,
+		   stack_data->resident_size + done);
+	spin_unlock(&stack_data->lock);
+
+	// the chunks whose values went into the top chunk of the stack, or
+	// that did not fit
+	list_for_each_entry_safe(chunk, tmp, &batch, list) {
+		list_del(&chunk->list);
+		stack_chunk_free(chunk);
+	}
+
+	if (done == 0)
+		goto retry;
+
+	wake_up_interruptible(&stack_data->read_queue);
+
+	return done;
+}
+
+/**
+ * @brief Open the device, the shared area is only allocated by mmap().
+ *
+ * The file works on the stack of its minor, or on a new stack of its own if
+ * private_stacks is set.
+ *
+ * @param inode inode of the device file
+ * @param filp pointer to the file descriptor in use
+ *
+ * @return 0, or a negative error code
+ */
+static int stack_open(struct inode *inode, struct file *filp)
+{
+	struct stack_file *file;
+
+	file = kzalloc(sizeof(*file), GFP_KERNEL);
+	if (!file)
+		return -ENOMEM;
+
+	if (private_stacks) {
+		file->stack_data = kmalloc(sizeof(*file->stack_data),
+					   GFP_KERNEL);
+		if (!file->stack_data) {
+			kfree(file);
+			return -ENOMEM;
+		}
+		stack_data_init(file->stack_data);
+		file->private = true;
+	} else {
+		file->stack_data = &stack_driver.stacks[iminor(inode)];
+	}
+
+	mutex_init(&file->shm_mutex);
+	filp->private_data = file;
+
+	return 0;
+}
+
+/**
+ * @brief Release the device, and the shared area if it was mapped.
+ *
+ * @param inode inode of the device file
+ * @param filp pointer to the file descriptor in use
+ *
+ * @return 0
+ */
+static int stack_release(struct inode *inode, struct file *filp)
+{
+	struct stack_file *file = filp->private_data;
+
+	// the mappings hold a reference on the file, so the area is no longer
+	// mapped here
+	vfree(file->shm);
+
+	if (file->private) {
+		stack_data_clear(file->stack_data);
+		kfree(file->stack_data);
+	}
+	kfree(file);
+
+	return 0;
+}
+
+/**
+ * @brief Pop and return latest added element of the stack.
+ *
+ * @param filp pointer to the file descriptor in use
+ * @param buf destination buffer in user space
+ * @param count maximum number of byte to read
+ * @param ppos ignored
+ *
+ * @return Actual number of bytes read from internal buffer,
+ *         or a negative error code
+ */
+
+static ssize_t stack_read(struct file *filp, char __user *buf, size_t count,
+			  loff_t *ppos)
+{
+	struct stack_file *file = filp->private_data;
+	ssize_t ret;
+
+	if (count % sizeof(uint32_t) != 0)
+		return -EINVAL;
+
+	ret = stack_pop(file->stack_data, buf, NULL, count / sizeof(uint32_t),
+			filp->f_flags & O_NONBLOCK);
+	if (ret < 0)
+		return ret;
 
 	// do not return count, because if the stack is smaller than count we
 	// should return the actual number of bytes read
-	return nb_values * sizeof(uint32_t);
+	return ret * sizeof(uint32_t);
 }
 
 /**
@@ -121,51 +1017,125 @@ static ssize_t stack_read(struct file *filp, char __user *buf, size_t count,
 static ssize_t stack_write(struct file *filp, const char __user *buf,
 			   size_t count, loff_t *ppos)
 {
-	struct stack_data *stack_data;
-	ssize_t nb_values;
-	uint32_t *new_values;
-	struct stack_node *elements;
-
-	// get stack data from the class device contained into the file
-	stack_data =
-		container_of(filp->f_inode->i_cdev, struct stack_data, cdev);
-	if (!stack_data) {
-		pr_err("Stack: Unable to retrieve stack_data\n");
-		return -ENODEV;
-	}
+	struct stack_file *file = filp->private_data;
+	ssize_t ret;
 
 	if (count % sizeof(uint32_t) != 0)
 		return -EINVAL;
 
-	nb_values = count / sizeof(uint32_t);
-	new_values = kmalloc(count, GFP_KERNEL);
+	ret = stack_push(file->stack_data, buf, NULL, count / sizeof(uint32_t),
+			 filp->f_flags & O_NONBLOCK);
+	if (ret < 0)
+		return ret;
 
-	if (!new_values)
-		return -ENOMEM;
+	return ret * sizeof(uint32_t);
+}
 
-	if (copy_from_user(new_values, buf, count) != 0) {
-		kfree(new_values);
-		pr_err("Stack: Failed to copy buffer from user\n");
-		return -EFAULT;
-	}
+/**
+ * @brief Tell whether the stack can be read or written without sleeping.
+ *
+ * @param filp pointer to the file descriptor in use
+ * @param wait poll table given by the kernel
+ *
+ * @return Mask of the events that are ready
+ */
+static __poll_t stack_poll(struct file *filp, poll_table *wait)
+{
+	struct stack_data *stack_data =
+		((struct stack_file *)filp->private_data)->stack_data;
+	__poll_t mask = 0;
 
-	elements =
-		kmalloc_array(nb_values, sizeof(struct stack_node), GFP_KERNEL);
-	if (!elements) {
-		kfree(new_values);
-		pr_err("Stack: Failed to allocate memory for stack elements\n");
-		return -ENOMEM;
+	poll_wait(filp, &stack_data->read_queue, wait);
+	poll_wait(filp, &stack_data->write_queue, wait);
+
+	if (READ_ONCE(stack_data->stack_size) > 0)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (stack_room(stack_data) > 0)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+/**
+ * @brief Map the area shared with the user.
+ *
+ * The area is allocated on the first mmap(), and always mapped from offset 0.
+ * Since it was obtained with vmalloc_user(), remap_vmalloc_range() does all
+ * the page-table work.
+ *
+ * @param filp pointer to the file descriptor in use
+ * @param vma user space memory area to be mapped
+ *
+ * @return 0, or a negative error code
+ */
+static int stack_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct stack_file *file = filp->private_data;
+	int err = 0;
+
+	if (vma->vm_pgoff != 0 ||
+	    vma->vm_end - vma->vm_start > STACK_SHM_SIZE) {
+		pr_err("Stack: Invalid mmap() offset or size\n");
+		return -EINVAL;
 	}
 
-	for (ssize_t i = 0; i < nb_values; i++) {
-		elements[i].value = new_values[i];
-		list_add(&elements[i].list, &stack_data->head);
+	mutex_lock(&file->shm_mutex);
+	if (!file->shm) {
+		file->shm = vmalloc_user(STACK_SHM_SIZE);
+		if (!file->shm) {
+			err = -ENOMEM;
+			goto unlock;
+		}
 	}
+	err = remap_vmalloc_range(vma, file->shm, 0);
 
-	stack_data->stack_size += nb_values;
+unlock:
+	mutex_unlock(&file->shm_mutex);
+	return err;
+}
 
-	kfree(new_values);
-	return count;
+/**
+ * @brief Push or pop the values of the shared area.
+ *
+ * STACK_IOC_PUSH_N pushes the first 'arg' values of the area, the first one
+ * first, as a write() of these values would. STACK_IOC_POP_N pops up to 'arg'
+ * values into the area, the latest added first, as a read() would. The values
+ * are moved with memcpy(), the area being kernel memory. Both sleep as the
+ * syscalls do, unless the file is non-blocking.
+ *
+ * @param filp pointer to the file descriptor in use
+ * @param cmd STACK_IOC_PUSH_N or STACK_IOC_POP_N
+ * @param arg number of values
+ *
+ * @return Number of values pushed or popped, or a negative error code
+ */
+static long stack_ioctl(struct file *filp, unsigned int cmd,
+			unsigned long arg)
+{
+	struct stack_file *file = filp->private_data;
+	bool nonblock = filp->f_flags & O_NONBLOCK;
+	uint32_t *shm;
+
+	if (cmd != STACK_IOC_PUSH_N && cmd != STACK_IOC_POP_N)
+		return -ENOTTY;
+
+	if (arg > STACK_SHM_VALUES)
+		return -EINVAL;
+
+	// once allocated, the area stays until the file is released, which
+	// cannot happen during an ioctl: the mutex is only needed to see it,
+	// and must not be held while sleeping, or a blocked POP_N would keep
+	// the other threads of the process from pushing through the same file
+	mutex_lock(&file->shm_mutex);
+	shm = file->shm;
+	mutex_unlock(&file->shm_mutex);
+
+	if (!shm)
+		return -ENXIO;
+
+	if (cmd == STACK_IOC_PUSH_N)
+		return stack_push(file->stack_data, NULL, shm, arg, nonblock);
+	return stack_pop(file->stack_data, NULL, shm, arg, nonblock);
 }
 
 /**
@@ -181,96 +1151,243 @@ static int stack_uevent(struct device *dev, struct kobj_uevent_env *env)
 	return 0;
 }
 
+/**
+ * @brief Show the number of values of the stack held in memory.
+ */
+static ssize_t resident_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct stack_data *stack_data = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%zd\n", READ_ONCE(stack_data->resident_size));
+}
+static DEVICE_ATTR_RO(resident);
+
+/**
+ * @brief Show the number of values of the stack spilled to shmem.
+ */
+static ssize_t spilled_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct stack_data *stack_data = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%zd\n", READ_ONCE(stack_data->spilled_size));
+}
+static DEVICE_ATTR_RO(spilled);
+
+/**
+ * @brief Show the number of bytes the spill file may hold in shmem.
+ *
+ * Larger than what the spilled values need if pages of values read back could
+ * not be released yet.
+ */
+static ssize_t spill_bytes_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct stack_data *stack_data = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lld\n",
+			  (loff_t)READ_ONCE(stack_data->spill_end) *
+				  STACK_CHUNK_SIZE);
+}
+static DEVICE_ATTR_RO(spill_bytes);
+
+static struct attribute *stack_attrs[] = {
+	&dev_attr_resident.attr,
+	&dev_attr_spilled.attr,
+	&dev_attr_spill_bytes.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(stack);
+
 static const struct file_operations stack_fops = {
 	.owner = THIS_MODULE,
+	.open = stack_open,
+	.release = stack_release,
 	.read = stack_read,
 	.write = stack_write,
+	.poll = stack_poll,
+	.mmap = stack_mmap,
+	.unlocked_ioctl = stack_ioctl,
 };
 
+/**
+ * @brief Create a device file for each stack.
+ *
+ * @return 0, or a negative error code
+ */
+static int stack_create_devices(void)
+{
+	struct device *dev;
+	unsigned int i;
+
+	for (i = 0; i < nb_stacks; i++) {
+		// the first stack keeps the historical name
+		if (i == 0)
+			dev = device_create(stack_driver.cl, NULL,
+					    stack_driver.devt,
+					    &stack_driver.stacks[i],
+					    DEVICE_NAME);
+		else
+			dev = device_create(stack_driver.cl, NULL,
+					    stack_driver.devt + i,
+					    &stack_driver.stacks[i],
+					    DEVICE_NAME "%u", i);
+		if (IS_ERR(dev)) {
+			while (i-- > 0)
+				device_destroy(stack_driver.cl,
+					       stack_driver.devt + i);
+			return PTR_ERR(dev);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Remove the device files of all the stacks.
+ */
+static void stack_destroy_devices(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nb_stacks; i++)
+		device_destroy(stack_driver.cl, stack_driver.devt + i);
+}
+
 static int __init stack_init(void)
 {
+	unsigned int i;
 	int err;
-	struct stack_data *stack_data;
 
-	// Allocate memory for the device
-	stack_data = kzalloc(sizeof(struct stack_data), GFP_KERNEL);
-	if (stack_data == NULL) {
-		pr_err("Stack: Error allocating memory for the device\n");
+	if (capacity == 0 || nb_stacks == 0) {
+		pr_err("Stack: The capacity and the number of stacks must be positive\n");
+		return -EINVAL;
+	}
+
+	stack_magazines = alloc_percpu(struct stack_magazine);
+	if (!stack_magazines) {
+		pr_err("Stack: Error allocating the chunk magazines\n");
 		return -ENOMEM;
 	}
 
-	// Initialize the stack
-	INIT_LIST_HEAD(&stack_data->head);
-	stack_data->stack_size = 0;
+	stack_chunk_cache = kmem_cache_create("stack_chunk", STACK_CHUNK_SIZE,
+					      0, 0, NULL);
+	if (!stack_chunk_cache) {
+		pr_err("Stack: Error creating the chunk cache\n");
+		err = -ENOMEM;
+		goto err_cache;
+	}
 
-	// Register the device
-	err = register_chrdev_region(MAJMIN, 1, DEVICE_NAME);
+	// stack_lru needs the id the registration gives to the shrinker, which
+	// does nothing until stack_list_mutex is released
+	mutex_lock(&stack_list_mutex);
+	err = register_shrinker(&stack_shrinker, "stack");
 	if (err != 0) {
-		pr_err("Stack: Registering char device failed\n");
-		kfree(stack_data);
-		return err;
+		mutex_unlock(&stack_list_mutex);
+		pr_err("Stack: Registering the shrinker failed\n");
+		goto err_shrinker;
+	}
+	err = list_lru_init_memcg(&stack_lru, &stack_shrinker);
+	mutex_unlock(&stack_list_mutex);
+	if (err != 0) {
+		pr_err("Stack: Error initializing the chunk lru\n");
+		goto err_lru;
 	}
 
-	stack_data->cl = class_create(THIS_MODULE, DEVICE_NAME);
-	if (stack_data->cl == NULL) {
-		pr_err("Stack: Error creating class\n");
-		unregister_chrdev_region(MAJMIN, 1);
-		kfree(stack_data);
-		return -1;
+	// Allocate and initialize the stacks
+	stack_driver.stacks = kcalloc(nb_stacks, sizeof(*stack_driver.stacks),
+				      GFP_KERNEL);
+	if (!stack_driver.stacks) {
+		pr_err("Stack: Error allocating memory for the stacks\n");
+		err = -ENOMEM;
+		goto err_stacks;
 	}
-	stack_data->cl->dev_uevent = stack_uevent;
-	stack_device =
-		device_create(stack_data->cl, NULL, MAJMIN, NULL, DEVICE_NAME);
+	for (i = 0; i < nb_stacks; i++)
+		stack_data_init(&stack_driver.stacks[i]);
 
-	if (stack_device == NULL) {
-		pr_err("Stack: Error creating device\n");
-		class_destroy(stack_data->cl);
-		unregister_chrdev_region(MAJMIN, 1);
-		kfree(stack_data);
-		return -1;
+	// Register the devices, with a major chosen by the kernel
+	err = alloc_chrdev_region(&stack_driver.devt, 0, nb_stacks,
+				  DEVICE_NAME);
+	if (err != 0) {
+		pr_err("Stack: Registering char device failed\n");
+		goto err_region;
 	}
 
-	// Set the device data
-	dev_set_drvdata(stack_device, stack_data);
+	stack_driver.cl = class_create(THIS_MODULE, DEVICE_NAME);
+	if (IS_ERR(stack_driver.cl)) {
+		pr_err("Stack: Error creating class\n");
+		err = PTR_ERR(stack_driver.cl);
+		goto err_class;
+	}
+	stack_driver.cl->dev_uevent = stack_uevent;
+	stack_driver.cl->dev_groups = stack_groups;
 
-	cdev_init(&stack_data->cdev, &stack_fops);
+	cdev_init(&stack_driver.cdev, &stack_fops);
 
-	err = cdev_add(&stack_data->cdev, MAJMIN, 1);
+	err = cdev_add(&stack_driver.cdev, stack_driver.devt, nb_stacks);
 	if (err < 0) {
 		pr_err("Stack: Adding char device failed\n");
-		device_destroy(stack_data->cl, MAJMIN);
-		class_destroy(stack_data->cl);
-		unregister_chrdev_region(MAJMIN, 1);
-		kfree(stack_data);
-		return err;
+		goto err_cdev;
+	}
+
+	err = stack_create_devices();
+	if (err != 0) {
+		pr_err("Stack: Error creating device\n");
+		goto err_devices;
 	}
 
-	pr_info("Stack ready!\n");
+	pr_info("Stack ready! %u stack(s), major %d\n", nb_stacks,
+		MAJOR(stack_driver.devt));
 	return 0;
+
+err_devices:
+	cdev_del(&stack_driver.cdev);
+err_cdev:
+	class_destroy(stack_driver.cl);
+err_class:
+	unregister_chrdev_region(stack_driver.devt, nb_stacks);
+err_region:
+	for (i = 0; i < nb_stacks; i++)
+		stack_data_clear(&stack_driver.stacks[i]);
+	kfree(stack_driver.stacks);
+err_stacks:
+	unregister_shrinker(&stack_shrinker);
+	list_lru_destroy(&stack_lru);
+	goto err_shrinker;
+err_lru:
+	unregister_shrinker(&stack_shrinker);
+err_shrinker:
+	kmem_cache_destroy(stack_chunk_cache);
+err_cache:
+	free_percpu(stack_magazines);
+	return err;
 }
 
 static void __exit stack_exit(void)
 {
-	struct stack_data *stack_data;
-	struct stack_node *node, *tmp;
-
-	stack_data = dev_get_drvdata(stack_device);
-	if (!stack_data) {
-		pr_err("Stack: Unable to retrieve stack_data\n");
-		return;
-	}
+	struct stack_magazine *mag;
+	unsigned int i;
+	int cpu;
 
-	list_for_each_entry_safe(node, tmp, &stack_data->head, list) {
-		list_del(&node->list);
-		kfree(node);
-	}
+	stack_destroy_devices();
+	cdev_del(&stack_driver.cdev);
+	class_destroy(stack_driver.cl);
+	unregister_chrdev_region(stack_driver.devt, nb_stacks);
+	unregister_shrinker(&stack_shrinker);
 
-	cdev_del(&stack_data->cdev);
-	device_destroy(stack_data->cl, MAJMIN);
-	class_destroy(stack_data->cl);
-	unregister_chrdev_region(MAJMIN, 1);
+	for (i = 0; i < nb_stacks; i++)
+		stack_data_clear(&stack_driver.stacks[i]);
+	kfree(stack_driver.stacks);
+	list_lru_destroy(&stack_lru);
 
-	kfree(stack_data);
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(stack_magazines, cpu);
+		for (i = 0; i < mag->count; i++)
+			kmem_cache_free(stack_chunk_cache, mag->chunks[i]);
+	}
+	free_percpu(stack_magazines);
+	kmem_cache_destroy(stack_chunk_cache);
 
 	pr_info("Stack cleaned up successfully!\n");
 }
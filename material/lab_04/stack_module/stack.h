@@ -0,0 +1,38 @@
+/* License-Identifier: GPL-2.0 */
+/*
+ * Stack --- interface shared with user space.
+ *
+ * Besides read() and write(), values can be moved in and out of the stack in
+ * bulk through an area shared with the driver: mmap() the device file at
+ * offset 0 for up to STACK_SHM_SIZE bytes (each open file has its own area),
+ * store the values to push in it and ring STACK_IOC_PUSH_N, or ring
+ * STACK_IOC_POP_N and find the values popped in it. The values are laid out
+ * as in the buffers of write() and read().
+ */
+#ifndef STACK_H
+#define STACK_H
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#else
+#include <sys/ioctl.h>
+#endif
+
+// Size of the shared area, in bytes and in values
+#define STACK_SHM_SIZE	 (256 * 1024)
+#define STACK_SHM_VALUES (STACK_SHM_SIZE / 4)
+
+#define STACK_IOC_MAGIC 's'
+// Push the first N values of the shared area (N is the argument of the
+// ioctl, at most STACK_SHM_VALUES). Returns the number of values pushed, which
+// is smaller than N if the stack got full.
+#define STACK_IOC_PUSH_N _IO(STACK_IOC_MAGIC, 0)
+// Pop up to N values into the shared area, the latest added first (N is the
+// argument of the ioctl, at most STACK_SHM_VALUES). Returns the number of
+// values popped.
+//
+// Like read() and write(), both sleep while the stack is empty (POP_N) or full
+// (PUSH_N), or fail with EAGAIN if the file is non-blocking.
+#define STACK_IOC_POP_N	 _IO(STACK_IOC_MAGIC, 1)
+
+#endif /* STACK_H */
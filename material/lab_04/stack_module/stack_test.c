@@ -1,16 +1,142 @@
+// License-Identifier: GPL-2.0
+/*
+ * Stack test, benchmark and stress harness
+ *
+ * First checks the behavior of an empty stack device with a single thread,
+ * then stresses it with concurrent pusher and popper threads for a while:
+ * - each pusher pushes batches of values tagged with its id and a sequence
+ *   number, so each popper checks that the values of a given pusher come out
+ *   of every read() in LIFO order (the values of a pusher still in the stack
+ *   are always in push order), and at the end that every value pushed was
+ *   popped exactly once;
+ * - the throughput (calls and values per second) and the latency percentiles
+ *   of the write()s and read()s are reported.
+ * The same workload is then run on a stack in the process (an array under a
+ * mutex), as a baseline to compare the driver with.
+ *
+ * Usage: stack_test [-D device] [-p pushers] [-c poppers] [-b batch[:max]]
+ *                   [-d seconds] [-f] [-s]
+ *   -b: batch size, or range of batch sizes drawn at random for each call
+ *   -f: only run the functional checks
+ *   -s: skip the functional checks (the stack may then be non-empty)
+ */
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "stack.h"
 
 #define ONE_BY_ONE_PUSH 16
 #define ONE_BY_ONE_POP 4
 #define ARRAY_POP 6
 #define ARRAY_RAND 5
 #define TMP_SIZE 256
+#define SHM_PUSH 3000
+
+#define DEVICE_PATH	 "/dev/stack"
+#define DEFAULT_PUSHERS	 2
+#define DEFAULT_POPPERS	 2
+#define DEFAULT_BATCH	 64
+#define DEFAULT_DURATION 2
+#define MAX_PUSHERS	 64
+// Latency samples kept per thread (the latest ones)
+#define LAT_SAMPLES	 (1 << 18)
+
+// A value tags its pusher and its sequence number (modulo 2^24)
+#define SEQ_BITS	   24
+#define SEQ_MASK	   ((1U << SEQ_BITS) - 1)
+#define VALUE(id, seq)	   (((uint32_t)(id) << SEQ_BITS) | ((seq) & SEQ_MASK))
+#define VALUE_ID(value)	   ((value) >> SEQ_BITS)
+#define VALUE_SEQ(value)   ((value) & SEQ_MASK)
+
+// Values handed over between two threads through the shared area
+#define SHM_HANDOFF 100
+
+static void *shm_handoff_pop(void *arg)
+{
+	int fd = *(int *)arg;
+
+	// the stack is empty: sleeps until the other thread pushes
+	return (void *)(intptr_t)ioctl(fd, STACK_IOC_POP_N, SHM_HANDOFF);
+}
+
+/**
+ * @brief Check that a blocked POP_N does not keep another thread from
+ *        pushing through the same file.
+ *
+ * The stack must be empty, and the file blocking.
+ *
+ * @param fd file of the stack
+ * @param shm shared area mapped from fd
+ *
+ * @return 0, or -1 if the check failed
+ */
+static int shm_handoff(int fd, uint32_t *shm)
+{
+	pthread_t popper;
+	void *popped;
+	ssize_t ret;
+	uint32_t i;
+
+	// a deadlock kills the test instead of hanging it
+	alarm(5);
+
+	if (pthread_create(&popper, NULL, shm_handoff_pop, &fd) != 0) {
+		perror("stack_test");
+		return -1;
+	}
+
+	// give the popper the time to block
+	usleep(100000);
+
+	for (i = 0; i < SHM_HANDOFF; i++)
+		shm[i] = i;
+
+	ret = ioctl(fd, STACK_IOC_PUSH_N, SHM_HANDOFF);
+	if (ret != SHM_HANDOFF) {
+		printf("Pushed %zd values instead of %d.\n", ret, SHM_HANDOFF);
+		return -1;
+	}
+
+	pthread_join(popper, &popped);
+	alarm(0);
+	if ((intptr_t)popped != SHM_HANDOFF) {
+		printf("Popped %zd values instead of %d.\n",
+		       (ssize_t)(intptr_t)popped, SHM_HANDOFF);
+		return -1;
+	}
+
+	for (i = 0; i < SHM_HANDOFF; i++) {
+		if (shm[i] != SHM_HANDOFF - 1 - i) {
+			printf("Popped %d is false. Got %u, expected %u.\n", i,
+			       shm[i], SHM_HANDOFF - 1 - i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
 
-int main(void)
+/**
+ * @brief Check the behavior of the stack with a single thread.
+ *
+ * The stack must be empty.
+ *
+ * @param path path of the device
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int functional_test(const char *path)
 {
 	int fd;
 	uint32_t tmp_array[TMP_SIZE];
@@ -18,9 +144,12 @@ int main(void)
 	uint32_t tmp;
 	uint32_t incremental_val = 0;
 	uint32_t i;
+	uint32_t *shm;
+	struct pollfd pfd;
 	ssize_t ret;
 
-	fd = open("/dev/stack", O_RDWR);
+	// non-blocking, so that reading the empty stack does not sleep
+	fd = open(path, O_RDWR | O_NONBLOCK);
 	if (fd < 0) {
 		perror("stack_test");
 		return EXIT_FAILURE;
@@ -28,8 +157,22 @@ int main(void)
 
 	printf("Testing emptyness.\n");
 	ret = read(fd, &tmp, sizeof(tmp));
-	if (ret != 0) {
-		printf("Stack read returned %d but should be empty!\n", ret);
+	if (ret != -1 || errno != EAGAIN) {
+		printf("Stack read returned %zd but should be empty!\n", ret);
+		return EXIT_FAILURE;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN | POLLOUT;
+	if (poll(&pfd, 1, 0) != 1 || pfd.revents != POLLOUT) {
+		printf("Empty stack should only be writable, got %#x.\n",
+		       pfd.revents);
+		return EXIT_FAILURE;
+	}
+
+	// the stack is never empty when read from now on
+	if (fcntl(fd, F_SETFL, 0) != 0) {
+		perror("stack_test");
 		return EXIT_FAILURE;
 	}
 
@@ -67,7 +210,7 @@ int main(void)
 		perror("stack_test");
 		return EXIT_FAILURE;
 	} else if (ret != sizeof(*tmp_array) * ARRAY_POP) {
-		printf("Readed %d element instead of %d.\n",
+		printf("Readed %zu element instead of %d.\n",
 		       ret / sizeof(*tmp_array), ARRAY_POP);
 		return EXIT_FAILURE;
 	}
@@ -100,7 +243,7 @@ int main(void)
 	}
 
 	if (ret != (ARRAY_RAND + incremental_val + 1) * sizeof(uint32_t)) {
-		printf("Not enough or too much data read. Got %d, expected %d\n",
+		printf("Not enough or too much data read. Got %zu, expected %u\n",
 		       ret / sizeof(uint32_t), (ARRAY_RAND + incremental_val + 1));
 		return EXIT_FAILURE;
 	}
@@ -124,6 +267,622 @@ int main(void)
 		i++;
 	}
 
+	printf("Pushing %d values through the shared area.\n", SHM_PUSH);
+	shm = mmap(NULL, STACK_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		   0);
+	if (shm == MAP_FAILED) {
+		perror("stack_test");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < SHM_PUSH; i++)
+		shm[i] = i;
+
+	ret = ioctl(fd, STACK_IOC_PUSH_N, SHM_PUSH);
+	if (ret != SHM_PUSH) {
+		printf("Pushed %zd values instead of %d.\n", ret, SHM_PUSH);
+		return EXIT_FAILURE;
+	}
+
+	printf("Poping %d values with read().\n", ONE_BY_ONE_PUSH);
+	ret = read(fd, tmp_array, sizeof(uint32_t) * ONE_BY_ONE_PUSH);
+	if (ret != sizeof(uint32_t) * ONE_BY_ONE_PUSH) {
+		printf("Readed %zu element instead of %d.\n",
+		       ret / sizeof(uint32_t), ONE_BY_ONE_PUSH);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < ONE_BY_ONE_PUSH; i++) {
+		if (tmp_array[i] != SHM_PUSH - 1 - i) {
+			printf("Readed %d is false. Got %u, expected %u.\n", i,
+			       tmp_array[i], SHM_PUSH - 1 - i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("Poping the rest through the shared area.\n");
+	ret = ioctl(fd, STACK_IOC_POP_N, SHM_PUSH);
+	if (ret != SHM_PUSH - ONE_BY_ONE_PUSH) {
+		printf("Popped %zd values instead of %d.\n", ret,
+		       SHM_PUSH - ONE_BY_ONE_PUSH);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < SHM_PUSH - ONE_BY_ONE_PUSH; i++) {
+		if (shm[i] != SHM_PUSH - ONE_BY_ONE_PUSH - 1 - i) {
+			printf("Popped %d is false. Got %u, expected %u.\n", i,
+			       shm[i], SHM_PUSH - ONE_BY_ONE_PUSH - 1 - i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("Unblocking a POP_N with a PUSH_N of another thread.\n");
+	if (shm_handoff(fd, shm) != 0)
+		return EXIT_FAILURE;
+
+	munmap(shm, STACK_SHM_SIZE);
+	close(fd);
+
+	printf("Functional checks run successfully!\n");
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Stack in the process, used as a baseline: an array under a mutex, with the
+ * semantics of the driver (a push of n values leaves the last one on top, a
+ * pop returns the top first) and its default capacity.
+ */
+#define USER_STACK_CAPACITY (1024 * 1024)
+
+static struct {
+	pthread_mutex_t lock;
+	uint32_t values[USER_STACK_CAPACITY];
+	size_t size;
+} user_stack = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static ssize_t user_stack_push(const uint32_t *values, size_t nb_values)
+{
+	pthread_mutex_lock(&user_stack.lock);
+	if (nb_values > USER_STACK_CAPACITY - user_stack.size)
+		nb_values = USER_STACK_CAPACITY - user_stack.size;
+	memcpy(&user_stack.values[user_stack.size], values,
+	       nb_values * sizeof(uint32_t));
+	user_stack.size += nb_values;
+	pthread_mutex_unlock(&user_stack.lock);
+
+	return nb_values;
+}
+
+static ssize_t user_stack_pop(uint32_t *values, size_t nb_values)
+{
+	size_t i;
+
+	pthread_mutex_lock(&user_stack.lock);
+	if (nb_values > user_stack.size)
+		nb_values = user_stack.size;
+	for (i = 0; i < nb_values; i++)
+		values[i] = user_stack.values[user_stack.size - 1 - i];
+	user_stack.size -= nb_values;
+	pthread_mutex_unlock(&user_stack.lock);
+
+	return nb_values;
+}
+
+// Configuration of a stress run
+struct stress_config {
+	const char *path; // NULL for the stack in the process
+	unsigned int pushers;
+	unsigned int poppers;
+	unsigned int batch_min;
+	unsigned int batch_max;
+	unsigned int duration;
+};
+
+struct worker {
+	pthread_t thread;
+	const struct stress_config *config;
+	unsigned int id;
+	unsigned int seed;
+	int fd; // -1 for the stack in the process
+	int error;
+
+	uint64_t calls;
+	uint64_t values;
+	uint64_t *latencies; // in ns, the latest LAT_SAMPLES calls
+	size_t nb_latencies;
+
+	// pushers: sum of the values pushed
+	uint64_t sum;
+	// poppers: number and sum of the values popped, per pusher
+	uint64_t popped[MAX_PUSHERS];
+	uint64_t popped_sum[MAX_PUSHERS];
+};
+
+// The pushers, then the poppers, are told to stop
+static volatile int stop_pushers;
+static volatile int stop_poppers;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int batch_size(struct worker *w)
+{
+	const struct stress_config *config = w->config;
+
+	if (config->batch_min == config->batch_max)
+		return config->batch_min;
+	return config->batch_min +
+	       rand_r(&w->seed) % (config->batch_max - config->batch_min + 1);
+}
+
+static void record_latency(struct worker *w, uint64_t start)
+{
+	w->latencies[w->calls % LAT_SAMPLES] = now_ns() - start;
+	w->calls++;
+	if (w->nb_latencies < LAT_SAMPLES)
+		w->nb_latencies++;
+}
+
+/**
+ * @brief Push values, on the device or on the stack in the process.
+ *
+ * @return Number of values pushed (0 if the stack in the process is full),
+ *         or -1
+ */
+static ssize_t worker_push(struct worker *w, const uint32_t *values,
+			   size_t nb_values)
+{
+	ssize_t ret;
+
+	if (w->fd < 0)
+		return user_stack_push(values, nb_values);
+
+	ret = write(w->fd, values, nb_values * sizeof(uint32_t));
+	return ret < 0 ? ret : ret / (ssize_t)sizeof(uint32_t);
+}
+
+/**
+ * @brief Pop values, from the device or from the stack in the process.
+ *
+ * @return Number of values popped, 0 if the stack is empty, or -1
+ */
+static ssize_t worker_pop(struct worker *w, uint32_t *values, size_t nb_values)
+{
+	ssize_t ret;
+
+	if (w->fd < 0)
+		return user_stack_pop(values, nb_values);
+
+	// the poppers' files are non-blocking, so that they can be stopped
+	ret = read(w->fd, values, nb_values * sizeof(uint32_t));
+	if (ret < 0 && errno == EAGAIN)
+		return 0;
+	return ret < 0 ? ret : ret / (ssize_t)sizeof(uint32_t);
+}
+
+/**
+ * @brief Wait a bit for values to pop (or for room, in the process).
+ */
+static void worker_wait(struct worker *w)
+{
+	struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+
+	if (w->fd < 0)
+		sched_yield();
+	else
+		poll(&pfd, 1, 10);
+}
+
+/**
+ * @brief Check and account the values returned by a pop.
+ *
+ * The values of a given pusher must have decreasing sequence numbers.
+ *
+ * @return 0, or -1 if the LIFO order is broken
+ */
+static int check_popped(struct worker *w, const uint32_t *values,
+			size_t nb_values)
+{
+	uint32_t last[MAX_PUSHERS];
+	uint64_t seen = 0;
+	uint32_t id, delta;
+	size_t i;
+
+	for (i = 0; i < nb_values; i++) {
+		id = VALUE_ID(values[i]);
+		if (id >= w->config->pushers) {
+			fprintf(stderr, "Popped unknown value %#x\n",
+				values[i]);
+			return -1;
+		}
+
+		if (seen & (1ULL << id)) {
+			// values of a pusher span less than 2^23 sequence
+			// numbers, the stack being smaller than that
+			delta = (VALUE_SEQ(last[id]) - VALUE_SEQ(values[i])) &
+				SEQ_MASK;
+			if (delta == 0 || delta >= (1U << (SEQ_BITS - 1))) {
+				fprintf(stderr,
+					"LIFO order broken for pusher %u: %u popped after %u\n",
+					id, VALUE_SEQ(values[i]),
+					VALUE_SEQ(last[id]));
+				return -1;
+			}
+		}
+		seen |= 1ULL << id;
+		last[id] = values[i];
+
+		w->popped[id]++;
+		w->popped_sum[id] += values[i];
+	}
+
+	w->values += nb_values;
+	return 0;
+}
+
+static void *pusher_run(void *arg)
+{
+	struct worker *w = arg;
+	uint32_t *values;
+	uint32_t seq = 0;
+	size_t n, done;
+	ssize_t ret;
+	uint64_t start;
+	size_t i;
+
+	values = malloc(w->config->batch_max * sizeof(uint32_t));
+	if (!values) {
+		w->error = 1;
+		return NULL;
+	}
+
+	while (!stop_pushers) {
+		n = batch_size(w);
+		for (i = 0; i < n; i++) {
+			values[i] = VALUE(w->id, seq + i);
+			w->sum += values[i];
+		}
+
+		// a write() may be short if the stack gets full
+		start = now_ns();
+		for (done = 0; done < n; done += ret) {
+			ret = worker_push(w, values + done, n - done);
+			if (ret < 0) {
+				perror("stack_test: push");
+				w->error = 1;
+				goto out;
+			}
+			if (ret == 0)
+				worker_wait(w);
+		}
+		record_latency(w, start);
+
+		seq += n;
+		w->values += n;
+	}
+
+out:
+	free(values);
+	return NULL;
+}
+
+static void *popper_run(void *arg)
+{
+	struct worker *w = arg;
+	uint32_t *values;
+	uint64_t start;
+	ssize_t ret;
+
+	values = malloc(w->config->batch_max * sizeof(uint32_t));
+	if (!values) {
+		w->error = 1;
+		return NULL;
+	}
+
+	while (!stop_poppers) {
+		start = now_ns();
+		ret = worker_pop(w, values, batch_size(w));
+		if (ret < 0) {
+			perror("stack_test: pop");
+			w->error = 1;
+			break;
+		}
+		if (ret == 0) {
+			worker_wait(w);
+			continue;
+		}
+		record_latency(w, start);
+
+		if (check_popped(w, values, ret) != 0) {
+			w->error = 1;
+			break;
+		}
+	}
+
+	free(values);
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Print the throughput and latency percentiles of some workers.
+ */
+static void report(const char *what, struct worker *workers,
+		   unsigned int nb_workers, double elapsed)
+{
+	uint64_t calls = 0, values = 0;
+	uint64_t *latencies;
+	size_t nb = 0, i;
+	unsigned int w;
+
+	for (w = 0; w < nb_workers; w++) {
+		calls += workers[w].calls;
+		values += workers[w].values;
+		nb += workers[w].nb_latencies;
+	}
+
+	printf("  %-4s %12.0f calls/s %14.0f values/s", what, calls / elapsed,
+	       values / elapsed);
+
+	latencies = malloc(nb * sizeof(*latencies));
+	if (nb == 0 || !latencies) {
+		printf("\n");
+		free(latencies);
+		return;
+	}
+
+	nb = 0;
+	for (w = 0; w < nb_workers; w++) {
+		for (i = 0; i < workers[w].nb_latencies; i++)
+			latencies[nb++] = workers[w].latencies[i];
+	}
+	qsort(latencies, nb, sizeof(*latencies), compare_u64);
+
+	printf("   latency (us) p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	       latencies[nb / 2] / 1e3, latencies[nb * 90 / 100] / 1e3,
+	       latencies[nb * 99 / 100] / 1e3,
+	       latencies[nb * 999 / 1000] / 1e3, latencies[nb - 1] / 1e3);
+
+	free(latencies);
+}
+
+static int worker_init(struct worker *w, const struct stress_config *config,
+		       unsigned int id, int flags)
+{
+	memset(w, 0, sizeof(*w));
+	w->config = config;
+	w->id = id;
+	w->seed = id * 7919 + time(NULL);
+	w->fd = -1;
+
+	w->latencies = malloc(LAT_SAMPLES * sizeof(*w->latencies));
+	if (!w->latencies)
+		return -1;
+
+	if (config->path) {
+		w->fd = open(config->path, O_RDWR | flags);
+		if (w->fd < 0) {
+			perror("stack_test: open");
+			free(w->latencies);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void worker_release(struct worker *w)
+{
+	if (w->fd >= 0)
+		close(w->fd);
+	free(w->latencies);
+}
+
+/**
+ * @brief Run the concurrent workload on a stack and check its results.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int stress_test(const struct stress_config *config)
+{
+	unsigned int nb_workers = config->pushers + config->poppers;
+	uint64_t popped, popped_sum;
+	struct worker *workers, *pushers, *poppers;
+	struct worker drain;
+	uint32_t *values;
+	uint64_t start;
+	double elapsed;
+	unsigned int i, w;
+	int error = 0;
+	ssize_t ret = 0;
+
+	printf("%s: %u pusher(s), %u popper(s), batches of %u to %u values, %u s\n",
+	       config->path ? config->path : "stack in the process",
+	       config->pushers, config->poppers, config->batch_min,
+	       config->batch_max, config->duration);
+
+	workers = calloc(nb_workers, sizeof(*workers));
+	values = malloc(config->batch_max * sizeof(uint32_t));
+	if (!workers || !values) {
+		free(workers);
+		free(values);
+		return EXIT_FAILURE;
+	}
+	pushers = workers;
+	poppers = workers + config->pushers;
+
+	for (w = 0; w < nb_workers; w++) {
+		if (worker_init(&workers[w], config, w,
+				w < config->pushers ? 0 : O_NONBLOCK) != 0) {
+			while (w-- > 0)
+				worker_release(&workers[w]);
+			free(workers);
+			free(values);
+			return EXIT_FAILURE;
+		}
+	}
+
+	stop_pushers = 0;
+	stop_poppers = 0;
+	start = now_ns();
+	for (w = 0; w < nb_workers; w++) {
+		if (pthread_create(&workers[w].thread, NULL,
+				   w < config->pushers ? pusher_run :
+							 popper_run,
+				   &workers[w]) != 0) {
+			perror("stack_test: pthread_create");
+			abort();
+		}
+	}
+
+	sleep(config->duration);
+
+	// the pushers may wait for room, the poppers make some
+	stop_pushers = 1;
+	for (w = 0; w < config->pushers; w++)
+		pthread_join(workers[w].thread, NULL);
+	stop_poppers = 1;
+	for (w = config->pushers; w < nb_workers; w++)
+		pthread_join(workers[w].thread, NULL);
+	elapsed = (now_ns() - start) / 1e9;
+
+	for (w = 0; w < nb_workers; w++)
+		error |= workers[w].error;
+
+	// pop what is left, checking it as well
+	if (worker_init(&drain, config, 0, O_NONBLOCK) != 0) {
+		error = 1;
+	} else {
+		while (!error &&
+		       (ret = worker_pop(&drain, values, config->batch_max)) > 0)
+			error |= check_popped(&drain, values, ret) != 0;
+		error |= ret < 0;
+		worker_release(&drain);
+	}
+
+	// every value pushed must have been popped exactly once
+	for (i = 0; i < config->pushers && !error; i++) {
+		popped = drain.popped[i];
+		popped_sum = drain.popped_sum[i];
+		for (w = 0; w < config->poppers; w++) {
+			popped += poppers[w].popped[i];
+			popped_sum += poppers[w].popped_sum[i];
+		}
+
+		if (popped != pushers[i].values ||
+		    popped_sum != pushers[i].sum) {
+			fprintf(stderr,
+				"Pusher %u pushed %llu values, %llu popped\n",
+				i, (unsigned long long)pushers[i].values,
+				(unsigned long long)popped);
+			error = 1;
+		}
+	}
+
+	if (!error) {
+		report("push", pushers, config->pushers, elapsed);
+		report("pop", poppers, config->poppers, elapsed);
+	}
+
+	for (w = 0; w < nb_workers; w++)
+		worker_release(&workers[w]);
+	free(workers);
+	free(values);
+
+	return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int parse_batch(const char *arg, struct stress_config *config)
+{
+	char *end;
+
+	config->batch_min = strtoul(arg, &end, 0);
+	config->batch_max = config->batch_min;
+	if (*end == ':')
+		config->batch_max = strtoul(end + 1, &end, 0);
+
+	return *end != '\0' || config->batch_min == 0 ||
+	       config->batch_max < config->batch_min;
+}
+
+int main(int argc, char **argv)
+{
+	struct stress_config config = {
+		.path = DEVICE_PATH,
+		.pushers = DEFAULT_PUSHERS,
+		.poppers = DEFAULT_POPPERS,
+		.batch_min = DEFAULT_BATCH,
+		.batch_max = DEFAULT_BATCH,
+		.duration = DEFAULT_DURATION,
+	};
+	int functional = 1, stress = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "D:p:c:b:d:fs")) != -1) {
+		switch (opt) {
+		case 'D':
+			config.path = optarg;
+			break;
+		case 'p':
+			config.pushers = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			config.poppers = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			if (parse_batch(optarg, &config) != 0) {
+				fprintf(stderr, "stack_test: invalid batch\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			config.duration = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			stress = 0;
+			break;
+		case 's':
+			functional = 0;
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-D device] [-p pushers] [-c poppers] [-b batch[:max]] [-d seconds] [-f] [-s]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (config.pushers == 0 || config.pushers > MAX_PUSHERS ||
+	    config.poppers == 0 || config.duration == 0) {
+		fprintf(stderr, "stack_test: 1 to %d pushers, at least a popper and a positive duration\n",
+			MAX_PUSHERS);
+		return EXIT_FAILURE;
+	}
+
+	if (functional && functional_test(config.path) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	if (stress) {
+		if (stress_test(&config) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+
+		config.path = NULL;
+		if (stress_test(&config) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
+
 	printf("Test run successfully!\n");
 	return EXIT_SUCCESS;
 }
@@ -50,11 +50,13 @@
  *   neither the pointed structure, nor the pointer itself, any attempt to do so
  *   in the function is a bug for sure, and the 'const' keyword would allow us to
  *   let the compiler catch this mistake for us.
- * - we can only deal with a single string of maximum fixed length at a time,
- *   that is, once the user writes a vector to encode, he/she has to read the
- *   encoded version before being able to encode the subsequent vector. Can we do
- *   any better? Of course, we could store the encoded strings in a list and
- *   return them once the user asks for them.
+ * - we can only deal with NR_BUFFERS strings of maximum fixed length at a time:
+ *   the internal buffers are used in a ping-pong fashion, so that the user can
+ *   write the next vector while the previous one is being encoded and read back
+ *   (e.g., from another thread), but once all the buffers are full he/she has to
+ *   read an encoded vector before being able to encode the subsequent one. Can
+ *   we do any better? Of course, we could store the encoded strings in a list
+ *   and return them once the user asks for them.
  * - our driver allows for encryption only -- can't we decrypt ? Yes, but we
  *   would need a mechanism to tell the driver what we want to do when we write a
  *   vector (encode or decode it?). We will see this in the coming weeks.
@@ -75,6 +77,7 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/cdev.h>
+#include <linux/mutex.h>
 
 /*
  * Offsets for the registers detailed in the documentation.
@@ -121,6 +124,29 @@
 /* Maximum length of a vector to encrypt. */
 #define MAX_VEC_LEN	 256
 
+/* Number of internal buffers, used in turn (ping-pong). */
+#define NR_BUFFERS	 2
+
+/*
+ * @struct ra_buffer
+ * @brief Internal buffer holding a vector.
+ *
+ * A buffer is owned by the writers while it is empty, and by the readers while
+ * it holds a vector: 'data_size' is what hands it over from one side to the
+ * other. It is thus set last (with a "release") by the side giving the buffer
+ * away, and checked first (with an "acquire") by the side taking it, so that
+ * the content of the buffer is always seen once 'data_size' says so.
+ *
+ * @var ra_buffer::data
+ * Vector to encrypt (encrypted in place).
+ * @var ra_buffer::data_size
+ * Number of elements currently in the buffer, 0 when it is free.
+ */
+struct ra_buffer {
+	int data[MAX_VEC_LEN + 1];
+	int data_size;
+};
+
 /*
  * @struct priv
  * @brief Private data for our driver.
@@ -137,10 +163,16 @@
  * Pointer to our device (will be useful when printing out messages).
  * @var priv::miscdev
  * MISC device file.
- * @var priv::buffer
- * Internal buffer for vector encryption.
- * @var priv::data_size
- * Number of elements currently in the internal buffer.
+ * @var priv::buffers
+ * Internal buffers for vector encryption.
+ * @var priv::write_idx
+ * Buffer the next write() fills.
+ * @var priv::read_idx
+ * Buffer the next read() encrypts and empties.
+ * @var priv::write_mutex
+ * Mutex serializing the write()s (they share 'write_idx').
+ * @var priv::read_mutex
+ * Mutex serializing the read()s (they share 'read_idx' and the counter).
  */
 struct priv {
 	void *mem_ptr;
@@ -148,8 +180,11 @@ struct priv {
 	struct device *dev;
 	struct miscdevice miscdev;
 
-	int buffer[MAX_VEC_LEN + 1];
-	int data_size;
+	struct ra_buffer buffers[NR_BUFFERS];
+	unsigned int write_idx;
+	unsigned int read_idx;
+	struct mutex write_mutex;
+	struct mutex read_mutex;
 };
 
 /*
@@ -224,8 +259,8 @@ static void ra_write(struct priv const *const priv, int const reg_offset,
 /*
  * @brief Initialization of the device file.
  *
- * The encryption process must start from a known state, therefore we reset the
- * internal counter.
+ * The encryption process must start from a known state, therefore we empty the
+ * internal buffers and reset the internal counter.
  *
  * @param inode: structure used by the kernel to hold file information
  * @param filp: higher-level file description, that tracks the current cursor
@@ -243,6 +278,7 @@ static int ra_file_open(struct inode *inode, struct file *filp)
 	 */
 	struct miscdevice *miscdev = filp->private_data;
 	struct priv *priv = container_of(miscdev, struct priv, miscdev);
+	int i;
 
 	dev_info(priv->dev,
 		 "called %s, resetting counter and initializing stuff\n", __func__);
@@ -253,8 +289,15 @@ static int ra_file_open(struct inode *inode, struct file *filp)
 	 */
 	filp->private_data = priv;
 
-	/* Reinitialize the length of the vector stored in the buffer. */
-	priv->data_size = 0;
+	/* Empty all the buffers, the first write() fills the first one. */
+	mutex_lock(&priv->write_mutex);
+	mutex_lock(&priv->read_mutex);
+	for (i = 0; i < NR_BUFFERS; ++i)
+		priv->buffers[i].data_size = 0;
+	priv->write_idx = 0;
+	priv->read_idx = 0;
+	mutex_unlock(&priv->read_mutex);
+	mutex_unlock(&priv->write_mutex);
 
 	/* Reset the counter used by the encryption process. */
 	ra_write(priv, INIT_REG_OFF, REINIT_CNT);
@@ -292,12 +335,16 @@ static int ra_file_release(struct inode *inode, struct file *filp)
 /*
  * @brief Retrieve an "encrypted" vector from the device.
  *
- * This is where the actual encryption is performed. For simplicity, we assume
- * that once you read from the device, even if only part of the vector has been
- * read, the current content of the whole buffer has to be discarded.
+ * This is where the actual encryption is performed, on the oldest buffer
+ * written. For simplicity, we assume that once you read from the device, even if
+ * only part of the vector has been read, the current content of the whole buffer
+ * has to be discarded (and the buffer goes back to the writers).
  * If more than the actual content of the buffer is asked, we return what we have
  * and then return an EOF.
  *
+ * Since the writers may fill the other buffer meanwhile, the counter is reset
+ * here, right before the encryption of each vector.
+ *
  * @param filp: pointer to the file descriptor in use
  * @param buf: data buffer used to discuss with the user space
  * @param count: size of the transfer requested
@@ -320,6 +367,11 @@ static ssize_t ra_file_read(struct file *filp, char __user *buf, size_t count,
 	/* Number of data values requested by the user. */
 	int ndata;
 
+	/* Buffer holding the vector to encrypt. */
+	struct ra_buffer *b;
+
+	ssize_t rc;
+
 	/*
 	 * To simplify our life, if the user asks for more than our buffer can
 	 * hold, we simply reject its request.
@@ -330,17 +382,22 @@ static ssize_t ra_file_read(struct file *filp, char __user *buf, size_t count,
 		return 0;
 	}
 
+	mutex_lock(&priv->read_mutex);
+	b = &priv->buffers[priv->read_idx];
+
 	dev_info(priv->dev,
-		 "called %s, count = %d, internal buf len = %d\n",
-		 __func__, count, priv->data_size);
+		 "called %s, count = %d, internal buf %u len = %d\n",
+		 __func__, count, priv->read_idx, READ_ONCE(b->data_size));
 
 	/*
 	 * Check that the internal buffer is not empty, otherwise the user hasn't
 	 * performed the required write().
 	 */
-	if (priv->data_size == 0) {
+	ndata = smp_load_acquire(&b->data_size);
+	if (ndata == 0) {
 		/* Return EOF. */
-		return 0;
+		rc = 0;
+		goto unlock;
 	}
 
 	/*
@@ -350,18 +407,21 @@ static ssize_t ra_file_read(struct file *filp, char __user *buf, size_t count,
 	if (count % sizeof(int) != 0) {
 		dev_err(priv->dev,
 			"read(): the encryption device operates on integers !\n");
-		return 0;
+		rc = 0;
+		goto unlock;
 	}
 
-	ndata = count / sizeof(int);
-	if (ndata > priv->data_size) {
+	if (ndata > count / sizeof(int)) {
 		/*
-		 * Here the user is trying to read more than what we have in
-		 * store, simply threshold his/her request.
+		 * Here the user is trying to read less than what we have in
+		 * store, we only encrypt what he/she asked for.
 		 */
-		ndata = priv->data_size;
+		ndata = count / sizeof(int);
 	}
 
+	/* Each vector starts from a known state. */
+	ra_write(priv, INIT_REG_OFF, REINIT_CNT);
+
 	/*
 	 * Perform the hardware-assisted encryption. This for loop will trigger a
 	 * set of interrupts each time we reach DEFAULT_THR, resetting each time
@@ -369,7 +429,7 @@ static ssize_t ra_file_read(struct file *filp, char __user *buf, size_t count,
 	 * values requested by the user.
 	 */
 	for (i = 0; i < ndata; ++i) {
-		priv->buffer[i] += ra_read(priv, VALUE_REG_OFF);
+		b->data[i] += ra_read(priv, VALUE_REG_OFF);
 		/*
 		 * ??????????
 		 * A bit of black magic happens here...
@@ -381,26 +441,32 @@ static ssize_t ra_file_read(struct file *filp, char __user *buf, size_t count,
 	}
 
 	/* Copy the data to the user. */
-	if (copy_to_user(buf, priv->buffer, ndata * sizeof(int)) != 0) {
+	if (copy_to_user(buf, b->data, ndata * sizeof(int)) != 0) {
 		dev_err(priv->dev,
 			"read(): error occurred in copy_to_user() operation !\n");
-		return -EFAULT;
+		rc = -EFAULT;
+	} else {
+		rc = ndata * sizeof(int);
 	}
 
 	/*
-	 * Reset the internal counter (equivalent to emptying our buffer).
+	 * Reset the internal counter (equivalent to emptying our buffer), which
+	 * hands the buffer back to the writers, and move on to the next one.
 	 */
-	priv->data_size = 0;
+	priv->read_idx = (priv->read_idx + 1) % NR_BUFFERS;
+	smp_store_release(&b->data_size, 0);
 
-	return ndata * sizeof(int);
+unlock:
+	mutex_unlock(&priv->read_mutex);
+	return rc;
 }
 
 /*
  * @brief Store a vector to encode in the internal buffer.
  *
  * For simplicity we assume that writes are one-shot, that is, the whole vector
- * to encrypt is written at once, and no subsequent writes are possible until the
- * encrypted vector is read.
+ * to encrypt is written at once, in the next free buffer. Once all the buffers
+ * are full, no subsequent writes are possible until an encrypted vector is read.
  *
  * @param filp: pointer to the file descriptor in use
  * @param buf: data buffer coming from user space
@@ -421,9 +487,12 @@ static ssize_t ra_file_write(struct file *filp, const char __user *buf,
 	/* Number of data values requested by the user. */
 	int const ndata = count / sizeof(int);
 
-	dev_info(priv->dev,
-		 "called %s, count = %d, internal buf len = %d\n",
-		 __func__, count, priv->data_size);
+	/* Buffer the vector is stored in. */
+	struct ra_buffer *b;
+
+	ssize_t rc;
+
+	dev_info(priv->dev, "called %s, count = %d\n", __func__, count);
 
 	/*
 	 * Since we operate on integers, we expect that the user offers a number
@@ -444,32 +513,40 @@ static ssize_t ra_file_write(struct file *filp, const char __user *buf,
 		return -EINVAL;
 	}
 
+	mutex_lock(&priv->write_mutex);
+	b = &priv->buffers[priv->write_idx];
+
 	/*
-	 * The internal buffer is not empty, therefore the user hasn't performed
-	 * the required read().
+	 * The next internal buffer is not empty, therefore the user hasn't
+	 * performed the required read()s.
 	 */
-	if (priv->data_size != 0) {
+	if (smp_load_acquire(&b->data_size) != 0) {
 		dev_err(priv->dev,
-			"write(): internal buffer not empty (missing read()?)\n");
-		return -EINVAL;
+			"write(): internal buffers not empty (missing read()?)\n");
+		rc = -EINVAL;
+		goto unlock;
 	}
 
 	/* Copy the data from the user into the buffer. */
-	if (copy_from_user(priv->buffer, buf, count) != 0) {
+	if (copy_from_user(b->data, buf, count) != 0) {
 		dev_err(priv->dev,
 			"write(): error occurred in copy_from_user() operation !\n");
-		return -EFAULT;
+		rc = -EFAULT;
+		goto unlock;
 	}
 
-	/* Reset the counter used by the encryption process. */
-	ra_write(priv, INIT_REG_OFF, REINIT_CNT);
-
 	/*
-	 * Set our internal data length.
+	 * Set our internal data length, which hands the buffer over to the
+	 * readers, and move on to the next one. The counter is reset by the
+	 * read(), since the previous vector may be being encrypted right now.
 	 */
-	priv->data_size = ndata;
+	priv->write_idx = (priv->write_idx + 1) % NR_BUFFERS;
+	smp_store_release(&b->data_size, ndata);
+	rc = count;
 
-	return count;
+unlock:
+	mutex_unlock(&priv->write_mutex);
+	return rc;
 }
 
 /*
@@ -575,6 +652,10 @@ static int reds_adder_probe(struct platform_device *pdev)
 	 */
 	priv->dev = &pdev->dev;
 
+	/* Initialize the mutexes of the readers and of the writers. */
+	mutex_init(&priv->write_mutex);
+	mutex_init(&priv->read_mutex);
+
 	/* Retrieve the address of the register's region from the DT. */
 	mem_info = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	if (unlikely(!mem_info)) {
@@ -9,8 +9,10 @@
  *   encrypted
  * - the size of the vector read can be smaller than the size of the written
  *   vector
- * - attempting to write twice in the device (without read()s in between) will
- *   result in an error
+ * - two vectors can be written in a row (the driver has two buffers, used in
+ *   turn), they are read back in order, each one encrypted from a reset counter
+ * - attempting to write a third time in the device (without read()s in between)
+ *   will result in an error
  * - reading from an empty buffer will not return a vector created from thin air
  * - trying to write a vector whose size is not a multiple of the size of an
  *   integer will result in an error
@@ -120,11 +122,38 @@ int main()
 	/* Now check multiple read()s and multiple write()s. */
 	rc = write(fd, msg1, strlen(msg1_char) * sizeof(int));
 	assert(rc == (int)strlen(msg1_char) * sizeof(int));
+	rc = write(fd, msg2, strlen(msg2_char) * sizeof(int));
+	assert(rc == (int)strlen(msg2_char) * sizeof(int));
 	fprintf(stderr, "\n!!! Expect some error messages below !!!\n");
 	rc = write(fd, msg1, strlen(msg1_char) * sizeof(int));
 	assert(rc == -1);
 	rc = read(fd, buf, BUF_SIZE * sizeof(int));
 	assert(rc == (int)strlen(msg1_char) * sizeof(int));
+	{
+		int incr = 1;
+		for (i = 0; i < (int)strlen(msg1_char); ++i, ++incr) {
+			assert(buf[i] == msg1[i] + incr);
+			if (incr == THR) {
+				incr = 0;
+			}
+		}
+	}
+	/* A buffer has been freed, a new vector can be written. */
+	rc = write(fd, msg1, strlen(msg1_char) * sizeof(int));
+	assert(rc == (int)strlen(msg1_char) * sizeof(int));
+	rc = read(fd, buf, BUF_SIZE * sizeof(int));
+	assert(rc == (int)strlen(msg2_char) * sizeof(int));
+	{
+		int incr = 1;
+		for (i = 0; i < (int)strlen(msg2_char); ++i, ++incr) {
+			assert(buf[i] == msg2[i] + incr);
+			if (incr == THR) {
+				incr = 0;
+			}
+		}
+	}
+	rc = read(fd, buf, BUF_SIZE * sizeof(int));
+	assert(rc == (int)strlen(msg1_char) * sizeof(int));
 	rc = read(fd, buf, BUF_SIZE * sizeof(int));
 	assert(rc == 0);
 
@@ -0,0 +1,426 @@
+/*
+ * Benchmark of the REDS-adder drivers.
+ * v3.1
+ *
+ * Writer threads push vectors of integers to the device while reader threads
+ * read the results back, for a given duration. At the end, a single CSV line is
+ * printed with the throughput (operations, i.e. vectors read, per second and
+ * MB/s) and the latency of the read()s that returned data (p50, p99, p999, in
+ * microseconds). For a blocking driver (v3), this latency includes the time a
+ * reader waited for a vector to be written.
+ *
+ * The same tool works with every version of the driver, so that they can be
+ * compared release over release:
+ * - v1 and v2 refuse a write while a vector is pending and return 0 on a read
+ *   when there is nothing to read, both are simply retried
+ * - v3 gives each open file its own context; the encrypt/decrypt mix is
+ *   obtained with one file per operation, selected with RA_IOC_SET_OP. The
+ *   older drivers only have the device-wide operation from sysfs, so they can
+ *   only be benchmarked with '-m 0' or '-m 100'.
+ *
+ * Usage: bench_v3 [-d device] [-l label] [-s ints] [-w writers] [-r readers]
+ *                 [-m decrypt %] [-t seconds] [-n]
+ *
+ * Example, comparing the drivers:
+ *   ./bench_v3 -d /dev/reds-adder -l v2 -m 0 > results.csv
+ *   ./bench_v3 -d /dev/reds-adder0 -l v3 -m 0 -n >> results.csv
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "reds_adder_v3.h"
+
+/* Default path to our device file. */
+#define DEV_PATH	"/dev/reds-adder0"
+
+/*
+ * Maximum size of a vector, in integers. This is the smallest limit of the
+ * drivers (v1 and v2 read at most 256 bytes at once).
+ */
+#define MAX_VEC_INTS	64
+
+/* Maximum number of reader and writer threads. */
+#define MAX_THREADS	64
+
+/* Maximum number of latency samples recorded by each reader. */
+#define MAX_SAMPLES	(1 << 20)
+
+/* Streams of vectors: one file per operation. */
+#define STREAM_ENC	0
+#define STREAM_DEC	1
+#define NR_STREAMS	2
+
+/* Configuration of the benchmark. */
+struct config {
+	char const *dev_path;
+	char const *label;
+	int vec_len;
+	int nr_writers;
+	int nr_readers;
+	int decrypt_pct;
+	int duration;
+	int header;
+};
+
+/* State of a reader thread. */
+struct reader {
+	pthread_t thread;
+	int stream;
+	unsigned long long ops;
+	unsigned long long bytes;
+	unsigned long long *samples;
+	size_t nr_samples;
+};
+
+/* State of a writer thread. */
+struct writer {
+	pthread_t thread;
+	unsigned int seed;
+};
+
+static struct config cfg = {
+	.dev_path = DEV_PATH,
+	.label = "v3",
+	.vec_len = 16,
+	.nr_writers = 1,
+	.nr_readers = 1,
+	.decrypt_pct = 0,
+	.duration = 5,
+	.header = 1,
+};
+
+/* File descriptor of each stream, -1 if unused. */
+static int stream_fd[NR_STREAMS] = { -1, -1 };
+/* Number of readers still running on each stream. */
+static int readers_alive[NR_STREAMS];
+/* Set by the main thread once the duration has elapsed. */
+static int stop;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Write a vector to a stream, retrying as long as the driver has no room for
+ * it. Returns 0 on success, -1 if the benchmark was stopped in between.
+ */
+static int write_vector(int fd, int const *vec)
+{
+	ssize_t rc;
+
+	for (;;) {
+		rc = write(fd, vec, cfg.vec_len * sizeof(int));
+		if (rc == (ssize_t)(cfg.vec_len * sizeof(int)))
+			return 0;
+		if (rc < 0 && errno != EINVAL && errno != EAGAIN &&
+		    errno != EINTR) {
+			perror("write");
+			exit(1);
+		}
+		if (__atomic_load_n(&stop, __ATOMIC_RELAXED))
+			return -1;
+		sched_yield();
+	}
+}
+
+void *writer(void *param)
+{
+	struct writer *w = (struct writer *)param;
+	int vec[MAX_VEC_INTS];
+	int stream;
+	int i;
+
+	for (i = 0; i < cfg.vec_len; ++i) {
+		vec[i] = 'A' + i;
+	}
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		stream = (int)(rand_r(&w->seed) % 100) < cfg.decrypt_pct ?
+			STREAM_DEC : STREAM_ENC;
+		if (write_vector(stream_fd[stream], vec))
+			break;
+	}
+	return NULL;
+}
+
+void *reader(void *param)
+{
+	struct reader *r = (struct reader *)param;
+	int buf[MAX_VEC_INTS];
+	unsigned long long start;
+	ssize_t rc;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		start = now_ns();
+		rc = read(stream_fd[r->stream], buf, cfg.vec_len * sizeof(int));
+		if (rc < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("read");
+			exit(1);
+		}
+		if (rc == 0) {
+			/* Nothing to read yet (v1/v2). */
+			sched_yield();
+			continue;
+		}
+		if (__atomic_load_n(&stop, __ATOMIC_RELAXED))
+			break;
+
+		r->ops++;
+		r->bytes += rc;
+		if (r->nr_samples < MAX_SAMPLES)
+			r->samples[r->nr_samples++] = now_ns() - start;
+	}
+
+	__atomic_sub_fetch(&readers_alive[r->stream], 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int cmp_ull(void const *a, void const *b)
+{
+	unsigned long long x = *(unsigned long long const *)a;
+	unsigned long long y = *(unsigned long long const *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Percentile 'p' (per thousand) of the sorted samples, in microseconds. */
+static double percentile(unsigned long long const *samples, size_t n, int p)
+{
+	size_t idx;
+
+	if (n == 0)
+		return 0.0;
+	idx = (n * p) / 1000;
+	if (idx >= n)
+		idx = n - 1;
+	return samples[idx] / 1000.0;
+}
+
+static void usage(char const *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-l label] [-s ints] [-w writers] "
+		"[-r readers] [-m decrypt %%] [-t seconds] [-n]\n"
+		"  -d  device file (default %s)\n"
+		"  -l  label of the run in the CSV (default v3)\n"
+		"  -s  size of the vectors, in integers (1-%d, default 16)\n"
+		"  -w  number of writer threads (default 1)\n"
+		"  -r  number of reader threads (default 1)\n"
+		"  -m  percentage of vectors decrypted (default 0)\n"
+		"  -t  duration in seconds (default 5)\n"
+		"  -n  do not print the CSV header\n",
+		prog, DEV_PATH, MAX_VEC_INTS);
+	exit(2);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:l:s:w:r:m:t:n")) != -1) {
+		switch (opt) {
+		case 'd':
+			cfg.dev_path = optarg;
+			break;
+		case 'l':
+			cfg.label = optarg;
+			break;
+		case 's':
+			cfg.vec_len = atoi(optarg);
+			break;
+		case 'w':
+			cfg.nr_writers = atoi(optarg);
+			break;
+		case 'r':
+			cfg.nr_readers = atoi(optarg);
+			break;
+		case 'm':
+			cfg.decrypt_pct = atoi(optarg);
+			break;
+		case 't':
+			cfg.duration = atoi(optarg);
+			break;
+		case 'n':
+			cfg.header = 0;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (cfg.vec_len < 1 || cfg.vec_len > MAX_VEC_INTS ||
+	    cfg.nr_writers < 1 || cfg.nr_writers > MAX_THREADS ||
+	    cfg.nr_readers < 1 || cfg.nr_readers > MAX_THREADS ||
+	    cfg.decrypt_pct < 0 || cfg.decrypt_pct > 100 ||
+	    cfg.duration < 1)
+		usage(argv[0]);
+}
+
+/* Open the file of a stream and select its operation. */
+static void open_stream(int stream)
+{
+	int op = stream == STREAM_DEC ? RA_OP_DECRYPT : RA_OP_ENCRYPT;
+
+	stream_fd[stream] = open(cfg.dev_path, O_RDWR);
+	if (stream_fd[stream] == -1) {
+		perror("open");
+		exit(1);
+	}
+
+	if (ioctl(stream_fd[stream], RA_IOC_SET_OP, op) == 0)
+		return;
+
+	/* v1/v2: only the operation selected through sysfs is available. */
+	if (cfg.decrypt_pct != 0 && cfg.decrypt_pct != 100) {
+		fprintf(stderr, "This driver has no per-file operation, use "
+				"-m 0 or -m 100 and select the operation "
+				"through sysfs !\n");
+		exit(1);
+	}
+	fprintf(stderr, "Note: using the operation selected through sysfs\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct writer writers[MAX_THREADS];
+	struct reader readers[MAX_THREADS];
+	unsigned long long *all_samples;
+	unsigned long long ops = 0;
+	unsigned long long bytes = 0;
+	unsigned long long start, elapsed;
+	size_t nr_samples = 0;
+	int vec[MAX_VEC_INTS] = { 0 };
+	int nr_dec_readers;
+	double secs;
+	int i;
+
+	parse_args(argc, argv);
+
+	/*
+	 * Readers are shared between the streams in proportion of the mix,
+	 * with at least one reader on each stream in use.
+	 */
+	nr_dec_readers = (cfg.nr_readers * cfg.decrypt_pct + 50) / 100;
+	if (cfg.decrypt_pct > 0 && nr_dec_readers == 0)
+		nr_dec_readers = 1;
+	if (cfg.decrypt_pct < 100 && nr_dec_readers == cfg.nr_readers)
+		nr_dec_readers--;
+	if ((cfg.decrypt_pct > 0 && nr_dec_readers == 0) ||
+	    (cfg.decrypt_pct < 100 && nr_dec_readers == cfg.nr_readers)) {
+		fprintf(stderr, "A mix of operations needs at least 2 readers !\n");
+		return 1;
+	}
+
+	if (cfg.decrypt_pct < 100)
+		open_stream(STREAM_ENC);
+	if (cfg.decrypt_pct > 0)
+		open_stream(STREAM_DEC);
+
+	for (i = 0; i < cfg.nr_readers; ++i) {
+		readers[i].stream = i < nr_dec_readers ? STREAM_DEC : STREAM_ENC;
+		readers[i].ops = 0;
+		readers[i].bytes = 0;
+		readers[i].nr_samples = 0;
+		readers[i].samples = malloc(MAX_SAMPLES * sizeof(*readers[i].samples));
+		if (readers[i].samples == NULL) {
+			fprintf(stderr, "Out of memory !\n");
+			return 1;
+		}
+		readers_alive[readers[i].stream]++;
+	}
+
+	start = now_ns();
+	for (i = 0; i < cfg.nr_readers; ++i) {
+		if (pthread_create(&readers[i].thread, NULL, reader, &readers[i])) {
+			fprintf(stderr, "create() error !\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < cfg.nr_writers; ++i) {
+		writers[i].seed = i + 1;
+		if (pthread_create(&writers[i].thread, NULL, writer, &writers[i])) {
+			fprintf(stderr, "create() error !\n");
+			return 1;
+		}
+	}
+
+	sleep(cfg.duration);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < cfg.nr_writers; ++i) {
+		if (pthread_join(writers[i].thread, NULL)) {
+			fprintf(stderr, "join() error !\n");
+			return 1;
+		}
+	}
+	/*
+	 * Readers of a blocking driver may be waiting for data that will never
+	 * come: feed them until they have all noticed the end of the run.
+	 */
+	for (i = 0; i < NR_STREAMS; ++i) {
+		while (__atomic_load_n(&readers_alive[i], __ATOMIC_ACQUIRE) > 0) {
+			/* Failures are fine, the FIFO is then not empty. */
+			if (write(stream_fd[i], vec, cfg.vec_len * sizeof(int)) < 0)
+				usleep(1000);
+		}
+	}
+	for (i = 0; i < cfg.nr_readers; ++i) {
+		if (pthread_join(readers[i].thread, NULL)) {
+			fprintf(stderr, "join() error !\n");
+			return 1;
+		}
+		ops += readers[i].ops;
+		bytes += readers[i].bytes;
+		nr_samples += readers[i].nr_samples;
+	}
+
+	/* Merge and sort the latency samples of all the readers. */
+	all_samples = malloc((nr_samples + 1) * sizeof(*all_samples));
+	if (all_samples == NULL) {
+		fprintf(stderr, "Out of memory !\n");
+		return 1;
+	}
+	nr_samples = 0;
+	for (i = 0; i < cfg.nr_readers; ++i) {
+		memcpy(all_samples + nr_samples, readers[i].samples,
+		       readers[i].nr_samples * sizeof(*all_samples));
+		nr_samples += readers[i].nr_samples;
+		free(readers[i].samples);
+	}
+	qsort(all_samples, nr_samples, sizeof(*all_samples), cmp_ull);
+
+	secs = elapsed / 1e9;
+	if (cfg.header)
+		printf("label,vec_ints,writers,readers,decrypt_pct,duration_s,"
+		       "ops,ops_per_s,mb_per_s,p50_us,p99_us,p999_us\n");
+	printf("%s,%d,%d,%d,%d,%.3f,%llu,%.1f,%.3f,%.2f,%.2f,%.2f\n",
+	       cfg.label, cfg.vec_len, cfg.nr_writers, cfg.nr_readers,
+	       cfg.decrypt_pct, secs, ops, ops / secs, bytes / secs / 1e6,
+	       percentile(all_samples, nr_samples, 500),
+	       percentile(all_samples, nr_samples, 990),
+	       percentile(all_samples, nr_samples, 999));
+
+	free(all_samples);
+	for (i = 0; i < NR_STREAMS; ++i) {
+		if (stream_fd[i] != -1)
+			close(stream_fd[i]);
+	}
+	return 0;
+}
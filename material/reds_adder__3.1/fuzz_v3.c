@@ -0,0 +1,443 @@
+/*
+ * Differential fuzzer of the REDS-adder driver.
+ * v3.1
+ *
+ * Random vectors (random length, random values, random operation) go through
+ * the driver, and what it returns is compared with what every implementation
+ * of the reference library (reds_adder_ref.c) computes for them. Both the
+ * read() stream of an open file (whose position keeps growing from one vector
+ * to the next) and the batch ioctl are exercised. The device can be a real
+ * REDS-adder, an emulated one (reds_adder_emu.ko) or the pool.
+ *
+ * With '-x', no device is used: the vector implementations of the library are
+ * checked against the plain C one, which is enough for a CI machine without
+ * the driver.
+ *
+ * On a mismatch, the seed is printed: running again with '-S seed' replays the
+ * exact same vectors.
+ *
+ * Usage: fuzz_v3 [-d device] [-t threshold file] [-n iterations] [-s ints]
+ *                [-S seed] [-c] [-x]
+ *
+ * Example, with the emulator:
+ *   insmod reds_adder_emu.ko && insmod reds_adder_v3.ko
+ *   ./fuzz_v3 -n 100000 -c
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "reds_adder_v3.h"
+#include "reds_adder_ref.h"
+
+/* Default path to our device file. */
+#define DEV_PATH	"/dev/reds-adder0"
+/* Default path to the threshold of the device. */
+#define THR_PATH	"/sys/class/ra/reds-adder0/device/ra_sysfs/threshold"
+
+/*
+ * Maximum size of a vector, in integers. The default one fits in the queue of
+ * the driver, larger ones rely on blocking writes/reads.
+ */
+#define MAX_VEC_INTS	65536
+/* Maximum number of vectors in a batch. */
+#define MAX_DESCS	4
+/* Largest threshold selected with '-c' (small ones wrap more often). */
+#define MAX_FUZZ_THR	40
+
+/* Implementations of the reference library that can be checked. */
+static char const *const impl_names[] = { "scalar", "sse2", "avx2", "neon" };
+#define NR_IMPLS	(sizeof(impl_names) / sizeof(impl_names[0]))
+
+/* Configuration of the fuzzer. */
+struct config {
+	char const *dev_path;
+	char const *thr_path;
+	long iterations;
+	int max_len;
+	unsigned long long seed;
+	int change_thr;
+	int no_device;
+};
+
+static struct config cfg = {
+	.dev_path = DEV_PATH,
+	.thr_path = THR_PATH,
+	.iterations = 10000,
+	.max_len = 256,
+	.change_thr = 0,
+	.no_device = 0,
+};
+
+/* Implementations available on this CPU. */
+static ra_ref_fn impls[NR_IMPLS];
+static char const *impls_name[NR_IMPLS];
+static int nr_impls;
+
+/* State of the pseudo-random generator (xorshift64*). */
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Random number in [lo, hi]. */
+static uint64_t rng_range(uint64_t lo, uint64_t hi)
+{
+	return lo + rng() % (hi - lo + 1);
+}
+
+static void fill_random(int *vec, int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		vec[i] = (int)(uint32_t)rng();
+	}
+}
+
+static void usage(char const *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-t threshold file] [-n iterations] "
+		"[-s ints] [-S seed] [-c] [-x]\n"
+		"  -d  device file (default %s)\n"
+		"  -t  sysfs file of the threshold (default %s)\n"
+		"  -n  number of iterations (default 10000)\n"
+		"  -s  maximum size of the vectors, in integers (1-%d, "
+		"default 256)\n"
+		"  -S  seed of the pseudo-random generator (default: time)\n"
+		"  -c  change the threshold from time to time (needs root)\n"
+		"  -x  no device, check the library against itself\n",
+		prog, DEV_PATH, THR_PATH, MAX_VEC_INTS);
+	exit(2);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+	int opt;
+
+	cfg.seed = (unsigned long long)time(NULL) ^ getpid();
+
+	while ((opt = getopt(argc, argv, "d:t:n:s:S:cx")) != -1) {
+		switch (opt) {
+		case 'd':
+			cfg.dev_path = optarg;
+			break;
+		case 't':
+			cfg.thr_path = optarg;
+			break;
+		case 'n':
+			cfg.iterations = atol(optarg);
+			break;
+		case 's':
+			cfg.max_len = atoi(optarg);
+			break;
+		case 'S':
+			cfg.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.change_thr = 1;
+			break;
+		case 'x':
+			cfg.no_device = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (cfg.iterations < 1 || cfg.max_len < 1 ||
+	    cfg.max_len > MAX_VEC_INTS)
+		usage(argv[0]);
+}
+
+static unsigned int read_threshold(void)
+{
+	unsigned int thr = 0;
+	FILE *f;
+
+	f = fopen(cfg.thr_path, "r");
+	if (f == NULL || fscanf(f, "%u", &thr) != 1 || thr == 0) {
+		fprintf(stderr, "Cannot read the threshold from %s, use -t !\n",
+			cfg.thr_path);
+		exit(1);
+	}
+	fclose(f);
+	return thr;
+}
+
+/* Change the threshold, it applies to the vectors read from now on. */
+static void write_threshold(unsigned int thr)
+{
+	int fd;
+
+	fd = open(cfg.thr_path, O_WRONLY);
+	if (fd == -1) {
+		perror("open threshold");
+		exit(1);
+	}
+	if (dprintf(fd, "%u", thr) <= 0) {
+		fprintf(stderr, "Cannot change the threshold !\n");
+		exit(1);
+	}
+	close(fd);
+}
+
+/*
+ * Compare a vector returned by the driver (or the plain C implementation) with
+ * every implementation of the library. 'in' is the vector before processing.
+ */
+static void check(char const *what, long iteration, int const *in,
+		  int const *out, int len, int op, unsigned int thr,
+		  uint64_t pos, int *expected)
+{
+	int n;
+	int i;
+
+	for (n = 0; n < nr_impls; ++n) {
+		memcpy(expected, in, len * sizeof(int));
+		impls[n](expected, len, op, thr, pos);
+		for (i = 0; i < len; ++i) {
+			if (expected[i] == out[i])
+				continue;
+			fprintf(stderr,
+				"MISMATCH (%s, seed %llu, iteration %ld): %s, "
+				"threshold %u, position %llu, len %d: "
+				"[%d] %d -> %d, %s expects %d\n",
+				what, cfg.seed, iteration,
+				op == RA_OP_ENCRYPT ? "encrypt" : "decrypt",
+				thr, (unsigned long long)pos + i, len, i, in[i],
+				out[i], impls_name[n], expected[i]);
+			exit(1);
+		}
+	}
+}
+
+/* Write a whole vector, the driver may take it in pieces. */
+static void write_all(int fd, int const *vec, int len)
+{
+	char const *p = (char const *)vec;
+	size_t left = len * sizeof(int);
+	ssize_t rc;
+
+	while (left) {
+		rc = write(fd, p, left);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(1);
+		}
+		p += rc;
+		left -= rc;
+	}
+}
+
+/* Vector written to the stream while it is read back. */
+struct stream_write {
+	int fd;
+	int const *vec;
+	int len;
+};
+
+static void *stream_writer(void *param)
+{
+	struct stream_write const *w = param;
+
+	write_all(w->fd, w->vec, w->len);
+	return NULL;
+}
+
+/* Read a whole vector, the driver may give it in pieces. */
+static void read_all(int fd, int *vec, int len)
+{
+	char *p = (char *)vec;
+	size_t left = len * sizeof(int);
+	ssize_t rc;
+
+	while (left) {
+		rc = read(fd, p, left);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(1);
+		}
+		p += rc;
+		left -= rc;
+	}
+}
+
+/* One random vector through the read() stream of the file. */
+static void fuzz_stream(int fd, long iteration, unsigned int thr,
+			uint64_t *pos, int *in, int *out, int *expected)
+{
+	int len = rng_range(1, cfg.max_len);
+	int op = rng() & 1 ? RA_OP_DECRYPT : RA_OP_ENCRYPT;
+	struct stream_write w = { .fd = fd, .vec = in, .len = len };
+	pthread_t writer;
+
+	if (ioctl(fd, RA_IOC_SET_OP, op)) {
+		perror("ioctl(RA_IOC_SET_OP)");
+		exit(1);
+	}
+
+	fill_random(in, len);
+	/*
+	 * The write() of a vector larger than the queue of the driver only
+	 * returns once the rest of it has been read: it comes from a thread of
+	 * its own.
+	 */
+	if (pthread_create(&writer, NULL, stream_writer, &w)) {
+		fprintf(stderr, "Cannot create the writer thread !\n");
+		exit(1);
+	}
+	read_all(fd, out, len);
+	if (pthread_join(writer, NULL)) {
+		fprintf(stderr, "Cannot join the writer thread !\n");
+		exit(1);
+	}
+
+	check("read()", iteration, in, out, len, op, thr, *pos, expected);
+	*pos += len;
+}
+
+/* A batch of random vectors, each one starts at the beginning of the period. */
+static void fuzz_batch(int fd, long iteration, unsigned int thr, int *in,
+		       int *out, int *expected)
+{
+	struct ra_desc descs[MAX_DESCS];
+	struct ra_batch batch;
+	int count = rng_range(1, MAX_DESCS);
+	int offset = 0;
+	int len;
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		len = rng_range(1, cfg.max_len / count > 0 ?
+					   cfg.max_len / count : 1);
+		descs[i].in = (uintptr_t)(in + offset);
+		descs[i].out = (uintptr_t)(out + offset);
+		descs[i].len = len;
+		descs[i].op = rng() & 1 ? RA_OP_DECRYPT : RA_OP_ENCRYPT;
+		offset += len;
+	}
+	fill_random(in, offset);
+
+	batch.descs = (uintptr_t)descs;
+	batch.count = count;
+	batch.pad = 0;
+	if (ioctl(fd, RA_IOC_BATCH, &batch) != count) {
+		perror("ioctl(RA_IOC_BATCH)");
+		exit(1);
+	}
+
+	offset = 0;
+	for (i = 0; i < count; ++i) {
+		check("batch", iteration, in + offset, out + offset,
+		      descs[i].len, descs[i].op, thr, 0, expected);
+		offset += descs[i].len;
+	}
+}
+
+/* One random vector through the plain C implementation (no device). */
+static void fuzz_self(long iteration, int *in, int *out, int *expected)
+{
+	int len = rng_range(1, cfg.max_len);
+	int op = rng() & 1 ? RA_OP_DECRYPT : RA_OP_ENCRYPT;
+	/* Mostly small thresholds, sometimes huge ones. */
+	unsigned int thr = rng() % 8 ? rng_range(1, MAX_FUZZ_THR) :
+				       rng_range(1, 0xFFFFFFFFU);
+	uint64_t pos = rng() % 4 ? rng_range(0, 1 << 20) : rng();
+
+	fill_random(in, len);
+	memcpy(out, in, len * sizeof(int));
+	impls[0](out, len, op, thr, pos);
+
+	check("self", iteration, in, out, len, op, thr, pos, expected);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int thr = 0;
+	uint64_t pos = 0;
+	int *in, *out, *expected;
+	long iteration;
+	unsigned int i;
+	int fd = -1;
+
+	parse_args(argc, argv);
+	rng_state = cfg.seed ? cfg.seed : 1;
+
+	for (i = 0; i < NR_IMPLS; ++i) {
+		impls[nr_impls] = ra_ref_get(impl_names[i]);
+		if (impls[nr_impls])
+			impls_name[nr_impls++] = impl_names[i];
+	}
+
+	in = malloc(cfg.max_len * sizeof(int));
+	out = malloc(cfg.max_len * sizeof(int));
+	expected = malloc(cfg.max_len * sizeof(int));
+	if (!in || !out || !expected) {
+		fprintf(stderr, "Out of memory !\n");
+		return 1;
+	}
+
+	fprintf(stderr, "Seed %llu, implementations:", cfg.seed);
+	for (i = 0; i < (unsigned int)nr_impls; ++i)
+		fprintf(stderr, " %s", impls_name[i]);
+	fprintf(stderr, " (best: %s)\n", ra_ref_best_name());
+
+	if (!cfg.no_device) {
+		fd = open(cfg.dev_path, O_RDWR);
+		if (fd == -1) {
+			perror("open");
+			return 1;
+		}
+		thr = read_threshold();
+	}
+
+	for (iteration = 0; iteration < cfg.iterations; ++iteration) {
+		if (cfg.no_device) {
+			fuzz_self(iteration, in, out, expected);
+			continue;
+		}
+
+		/*
+		 * The new threshold applies to the next vector: nothing is left
+		 * in the driver at this point.
+		 */
+		if (cfg.change_thr && rng() % 64 == 0) {
+			thr = rng_range(1, MAX_FUZZ_THR);
+			write_threshold(thr);
+		}
+
+		if (rng() % 4)
+			fuzz_stream(fd, iteration, thr, &pos, in, out, expected);
+		else
+			fuzz_batch(fd, iteration, thr, in, out, expected);
+	}
+
+	printf("%ld iterations, no mismatch\n", cfg.iterations);
+
+	if (fd != -1)
+		close(fd);
+	free(in);
+	free(out);
+	free(expected);
+	return 0;
+}
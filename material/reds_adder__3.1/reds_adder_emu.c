@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * REDS-adder emulator.
+ *
+ * This module models the register map of the REDS-adder in RAM and registers
+ * one (or more) "reds-adder" platform device(s), so that the REDS-adder driver
+ * can be loaded, profiled and tested on a machine without the DE1-SoC (e.g.,
+ * an x86 build server):
+ *   insmod reds_adder_emu.ko [nr_devices=N] [irq_delay_ns=D]
+ *   insmod reds_adder_v3.ko
+ *
+ * Without a device tree, the platform bus matches the device with the driver
+ * by name ("reds-adder"). The register accessors are given to the driver as
+ * platform data (see reds_adder_emu.h), and the interrupt is a real one: it
+ * comes from a small IRQ domain of our own, and is fired from an hrtimer
+ * 'irq_delay_ns' after the read that made the counter reach the threshold.
+ *
+ * As on the real device, the counter does not wrap by itself: it keeps
+ * incrementing until the counter is reinitialized (which the driver does in its
+ * interrupt handler).
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/platform_device.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irqdomain.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
+
+#include "reds_adder_emu.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("REDS");
+MODULE_DESCRIPTION("REDS-adder emulator");
+
+/*
+ * Offsets for the registers detailed in the documentation.
+ */
+#define ID_REG_OFF	 0x00
+#define INCR_REG_OFF	 0x04
+#define VALUE_REG_OFF	 0x08
+#define INIT_REG_OFF	 0x0C
+#define THRESH_REG_OFF	 0x10
+#define IRQ_MASK_REG_OFF 0x80
+#define IRQ_CAPT_REG_OFF 0x84
+
+/* Value of the ID register of the emulated device. */
+#define EMU_ID		 0x0ADDE12E
+/* Reinitialize the counter. */
+#define REINIT_CNT	 0x01
+/* Acknowledge a received interrupt. */
+#define ACK_IRQ		 0x01
+/* Threshold after reset. */
+#define DEFAULT_THR	 0x03
+
+/* Name of the emulated devices (the one the driver is registered with). */
+#define DEV_NAME	 "reds-adder"
+
+/* Maximum number of emulated devices. */
+#define MAX_DEVICES	 8
+
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of emulated devices (1-8)");
+
+static unsigned long irq_delay_ns = 2000;
+module_param(irq_delay_ns, ulong, 0644);
+MODULE_PARM_DESC(irq_delay_ns,
+		 "Delay between reaching the threshold and the interrupt (ns)");
+
+/**
+ * @struct ra_emu
+ * @brief State of an emulated device.
+ *
+ * @var ra_emu::lock
+ * Spinlock protecting the registers (taken from the driver's IRQ handler too).
+ * @var ra_emu::incr
+ * INCR register.
+ * @var ra_emu::value
+ * Current value of the counter.
+ * @var ra_emu::thresh
+ * THRESH register.
+ * @var ra_emu::irq_mask
+ * IRQ_MASK register.
+ * @var ra_emu::irq_capt
+ * IRQ_CAPT register (set when the interrupt is raised, cleared on ack).
+ * @var ra_emu::irq_timer
+ * Timer firing the interrupt.
+ * @var ra_emu::virq
+ * Linux interrupt number of the device.
+ * @var ra_emu::pdev
+ * Emulated platform device.
+ */
+struct ra_emu {
+	spinlock_t lock;
+	u32 incr;
+	u32 value;
+	u32 thresh;
+	u32 irq_mask;
+	u32 irq_capt;
+
+	struct hrtimer irq_timer;
+	unsigned int virq;
+	struct platform_device *pdev;
+};
+
+/* IRQ domain providing the interrupts of all the emulated devices. */
+static struct irq_domain *ra_emu_domain;
+/* Emulated devices. */
+static struct ra_emu *ra_emus[MAX_DEVICES];
+
+/**
+ * @brief Read a register of an emulated device.
+ *
+ * @param emu_ptr: emulated device
+ * @param reg_offset: offset (in bytes) of the desired register
+ *
+ * @return: value of the register.
+ */
+static u32 ra_emu_read(void *emu_ptr, unsigned int reg_offset)
+{
+	struct ra_emu *emu = emu_ptr;
+	unsigned long flags;
+	u32 value = 0;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	switch (reg_offset) {
+	case ID_REG_OFF:
+		value = EMU_ID;
+		break;
+	case INCR_REG_OFF:
+		value = emu->incr;
+		break;
+	case VALUE_REG_OFF:
+		/* Reading the counter is what makes it increment. */
+		emu->value += emu->incr;
+		value = emu->value;
+		if (emu->incr && value == emu->thresh && emu->irq_mask &&
+		    !emu->irq_capt) {
+			emu->irq_capt = 1;
+			hrtimer_start(&emu->irq_timer, ns_to_ktime(irq_delay_ns),
+				      HRTIMER_MODE_REL_HARD);
+		}
+		break;
+	case THRESH_REG_OFF:
+		value = emu->thresh;
+		break;
+	case IRQ_MASK_REG_OFF:
+		value = emu->irq_mask;
+		break;
+	case IRQ_CAPT_REG_OFF:
+		value = emu->irq_capt;
+		break;
+	}
+	spin_unlock_irqrestore(&emu->lock, flags);
+
+	return value;
+}
+
+/**
+ * @brief Write a register of an emulated device.
+ *
+ * @param emu_ptr: emulated device
+ * @param reg_offset: offset (in bytes) of the desired register
+ * @param value: value that has to be written
+ */
+static void ra_emu_write(void *emu_ptr, unsigned int reg_offset, u32 value)
+{
+	struct ra_emu *emu = emu_ptr;
+	unsigned long flags;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	switch (reg_offset) {
+	case INCR_REG_OFF:
+		emu->incr = value;
+		break;
+	case INIT_REG_OFF:
+		if (value == REINIT_CNT)
+			emu->value = 0;
+		break;
+	case THRESH_REG_OFF:
+		emu->thresh = value;
+		break;
+	case IRQ_MASK_REG_OFF:
+		emu->irq_mask = value;
+		break;
+	case IRQ_CAPT_REG_OFF:
+		if (value == ACK_IRQ)
+			emu->irq_capt = 0;
+		break;
+	}
+	spin_unlock_irqrestore(&emu->lock, flags);
+}
+
+/**
+ * @brief Fire the interrupt of an emulated device.
+ *
+ * Hard hrtimers expire in hardirq context, which is exactly where a real
+ * interrupt handler would run.
+ *
+ * @param timer: timer of the emulated device
+ *
+ * @return: HRTIMER_NORESTART.
+ */
+static enum hrtimer_restart ra_emu_irq_fire(struct hrtimer *timer)
+{
+	struct ra_emu *emu = container_of(timer, struct ra_emu, irq_timer);
+
+	generic_handle_irq(emu->virq);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * @brief Set up a new interrupt of our IRQ domain.
+ *
+ * There is no interrupt controller to talk to, so the dummy chip is enough.
+ *
+ * @param d: our IRQ domain
+ * @param virq: Linux interrupt number
+ * @param hw: index of the emulated device
+ *
+ * @return: 0.
+ */
+static int ra_emu_irq_map(struct irq_domain *d, unsigned int virq,
+			  irq_hw_number_t hw)
+{
+	irq_set_chip_and_handler(virq, &dummy_irq_chip, handle_simple_irq);
+	return 0;
+}
+
+static const struct irq_domain_ops ra_emu_irq_ops = {
+	.map = ra_emu_irq_map,
+	.xlate = irq_domain_xlate_onecell,
+};
+
+/**
+ * @brief Create and register an emulated device.
+ *
+ * @param index: index of the device
+ *
+ * @return: the device, or an ERR_PTR() in case of failure.
+ */
+static struct ra_emu *ra_emu_create(unsigned int index)
+{
+	struct platform_device_info pinfo = {};
+	struct ra_emu_ops ops;
+	struct resource res;
+	struct ra_emu *emu;
+	int rc;
+
+	emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+	if (!emu)
+		return ERR_PTR(-ENOMEM);
+
+	/* Reset values of the registers. */
+	spin_lock_init(&emu->lock);
+	emu->thresh = DEFAULT_THR;
+	hrtimer_init(&emu->irq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+	emu->irq_timer.function = ra_emu_irq_fire;
+
+	emu->virq = irq_create_mapping(ra_emu_domain, index);
+	if (!emu->virq) {
+		rc = -EINVAL;
+		goto free_emu;
+	}
+
+	res = (struct resource)DEFINE_RES_IRQ(emu->virq);
+	ops.read = ra_emu_read;
+	ops.write = ra_emu_write;
+	ops.emu = emu;
+
+	pinfo.name = DEV_NAME;
+	pinfo.id = PLATFORM_DEVID_AUTO;
+	pinfo.res = &res;
+	pinfo.num_res = 1;
+	/* The platform data is copied by the platform core. */
+	pinfo.data = &ops;
+	pinfo.size_data = sizeof(ops);
+
+	emu->pdev = platform_device_register_full(&pinfo);
+	if (IS_ERR(emu->pdev)) {
+		rc = PTR_ERR(emu->pdev);
+		goto dispose_irq;
+	}
+
+	return emu;
+
+dispose_irq:
+	irq_dispose_mapping(emu->virq);
+free_emu:
+	kfree(emu);
+	return ERR_PTR(rc);
+}
+
+/**
+ * @brief Unregister and free an emulated device.
+ *
+ * @param emu: emulated device
+ */
+static void ra_emu_destroy(struct ra_emu *emu)
+{
+	/* This unbinds the driver, which stops using the registers. */
+	platform_device_unregister(emu->pdev);
+	hrtimer_cancel(&emu->irq_timer);
+	irq_dispose_mapping(emu->virq);
+	kfree(emu);
+}
+
+static int __init ra_emu_init(void)
+{
+	unsigned int i;
+	int rc;
+
+	if (nr_devices == 0 || nr_devices > MAX_DEVICES) {
+		pr_err("REDS-adder emulator: invalid number of devices\n");
+		return -EINVAL;
+	}
+
+	ra_emu_domain = irq_domain_add_linear(NULL, nr_devices,
+					      &ra_emu_irq_ops, NULL);
+	if (!ra_emu_domain) {
+		pr_err("REDS-adder emulator: cannot create the IRQ domain\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_devices; ++i) {
+		ra_emus[i] = ra_emu_create(i);
+		if (IS_ERR(ra_emus[i])) {
+			rc = PTR_ERR(ra_emus[i]);
+			pr_err("REDS-adder emulator: cannot create device %u\n",
+			       i);
+			goto destroy_emus;
+		}
+	}
+
+	pr_info("REDS-adder emulator: %u device(s) ready\n", nr_devices);
+	return 0;
+
+destroy_emus:
+	while (i--)
+		ra_emu_destroy(ra_emus[i]);
+	irq_domain_remove(ra_emu_domain);
+	return rc;
+}
+
+static void __exit ra_emu_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_devices; ++i)
+		ra_emu_destroy(ra_emus[i]);
+	irq_domain_remove(ra_emu_domain);
+
+	pr_info("REDS-adder emulator: removed\n");
+}
+
+module_init(ra_emu_init);
+module_exit(ra_emu_exit);
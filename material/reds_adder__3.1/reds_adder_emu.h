@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * REDS-adder emulator --- interface with the driver.
+ *
+ * The emulated register block lives in RAM, where a read cannot have a side
+ * effect (and the counter increments on each read!). The emulator therefore
+ * hands its register accessors to the driver as platform data, and the driver
+ * uses them instead of ioread32()/iowrite32() when they are present.
+ */
+#ifndef REDS_ADDER_EMU_H
+#define REDS_ADDER_EMU_H
+
+#include <linux/types.h>
+
+/**
+ * @struct ra_emu_ops
+ * @brief Register accessors of an emulated REDS-adder.
+ *
+ * @var ra_emu_ops::read
+ * Read the register at the given offset (in bytes).
+ * @var ra_emu_ops::write
+ * Write a value to the register at the given offset (in bytes).
+ * @var ra_emu_ops::emu
+ * Emulator's state, passed back to the accessors.
+ */
+struct ra_emu_ops {
+	u32 (*read)(void *emu, unsigned int reg_offset);
+	void (*write)(void *emu, unsigned int reg_offset, u32 value);
+	void *emu;
+};
+
+#endif /* REDS_ADDER_EMU_H */
@@ -0,0 +1,236 @@
+/*
+ * Reference implementation of the REDS-adder, in user space.
+ * v3.1
+ *
+ * All the implementations work the same way: the values of the counter for the
+ * next N integers (N being the number of lanes of a vector register) are kept
+ * in a register 'k'. Moving on to the next N integers adds N to each lane,
+ * that is N % threshold once the full periods are removed, and a lane that went
+ * past the threshold wraps around by subtracting the threshold (once is
+ * enough, as every lane was at most the threshold before). There is no branch
+ * and no division in the loop, whatever the threshold.
+ *
+ * The additions are done on unsigned integers: an integer that overflows wraps
+ * around, as it does in the driver.
+ */
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RA_REF_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RA_REF_NEON
+#endif
+
+#include "reds_adder_v3.h"
+#include "reds_adder_ref.h"
+
+/*
+ * Largest threshold handled by the vector implementations: the lanes are
+ * compared as signed integers, so a lane must never go beyond INT32_MAX.
+ */
+#define VEC_MAX_THR	(1U << 30)
+
+/**
+ * @brief Values of the counter for the first integers of a vector.
+ *
+ * @param k: where to store the values
+ * @param lanes: number of values
+ * @param threshold: threshold of the device
+ * @param pos: position of the first integer in the stream
+ */
+static void ra_ref_first_keys(uint32_t *k, unsigned int lanes,
+			      unsigned int threshold, uint64_t pos)
+{
+	uint32_t phase = pos % threshold;
+	unsigned int i;
+
+	for (i = 0; i < lanes; ++i) {
+		k[i] = phase + 1;
+		if (++phase == threshold)
+			phase = 0;
+	}
+}
+
+/**
+ * @brief Plain C implementation, also used for the tail of the vectors.
+ *
+ * Within a period of the counter, the values are consecutive, so the vector is
+ * processed one period at a time.
+ */
+static void ra_ref_scalar(int *data, size_t len, int op,
+			  unsigned int threshold, uint64_t pos)
+{
+	uint32_t *d = (uint32_t *)data;
+	uint32_t phase = pos % threshold;
+	size_t i = 0;
+	size_t run;
+	size_t j;
+
+	while (i < len) {
+		run = threshold - phase;
+		if (run > len - i)
+			run = len - i;
+		if (op == RA_OP_ENCRYPT) {
+			for (j = 0; j < run; ++j)
+				d[i + j] += phase + 1 + j;
+		} else {
+			for (j = 0; j < run; ++j)
+				d[i + j] -= phase + 1 + j;
+		}
+		i += run;
+		phase = 0;
+	}
+}
+
+#ifdef RA_REF_X86
+__attribute__((target("sse2")))
+static void ra_ref_sse2(int *data, size_t len, int op, unsigned int threshold,
+			uint64_t pos)
+{
+	uint32_t first[4];
+	__m128i k, step, thr, d, wrap;
+	size_t i;
+
+	if (len < 4 || threshold > VEC_MAX_THR) {
+		ra_ref_scalar(data, len, op, threshold, pos);
+		return;
+	}
+
+	ra_ref_first_keys(first, 4, threshold, pos);
+	k = _mm_loadu_si128((__m128i const *)first);
+	step = _mm_set1_epi32(4 % threshold);
+	thr = _mm_set1_epi32(threshold);
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		d = _mm_loadu_si128((__m128i const *)(data + i));
+		if (op == RA_OP_ENCRYPT)
+			d = _mm_add_epi32(d, k);
+		else
+			d = _mm_sub_epi32(d, k);
+		_mm_storeu_si128((__m128i *)(data + i), d);
+
+		k = _mm_add_epi32(k, step);
+		wrap = _mm_cmpgt_epi32(k, thr);
+		k = _mm_sub_epi32(k, _mm_and_si128(wrap, thr));
+	}
+
+	ra_ref_scalar(data + i, len - i, op, threshold, pos + i);
+}
+
+__attribute__((target("avx2")))
+static void ra_ref_avx2(int *data, size_t len, int op, unsigned int threshold,
+			uint64_t pos)
+{
+	uint32_t first[8];
+	__m256i k, step, thr, d, wrap;
+	size_t i;
+
+	if (len < 8 || threshold > VEC_MAX_THR) {
+		ra_ref_sse2(data, len, op, threshold, pos);
+		return;
+	}
+
+	ra_ref_first_keys(first, 8, threshold, pos);
+	k = _mm256_loadu_si256((__m256i const *)first);
+	step = _mm256_set1_epi32(8 % threshold);
+	thr = _mm256_set1_epi32(threshold);
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		d = _mm256_loadu_si256((__m256i const *)(data + i));
+		if (op == RA_OP_ENCRYPT)
+			d = _mm256_add_epi32(d, k);
+		else
+			d = _mm256_sub_epi32(d, k);
+		_mm256_storeu_si256((__m256i *)(data + i), d);
+
+		k = _mm256_add_epi32(k, step);
+		wrap = _mm256_cmpgt_epi32(k, thr);
+		k = _mm256_sub_epi32(k, _mm256_and_si256(wrap, thr));
+	}
+
+	ra_ref_sse2(data + i, len - i, op, threshold, pos + i);
+}
+#endif /* RA_REF_X86 */
+
+#ifdef RA_REF_NEON
+static void ra_ref_neon(int *data, size_t len, int op, unsigned int threshold,
+			uint64_t pos)
+{
+	uint32_t *d32 = (uint32_t *)data;
+	uint32_t first[4];
+	uint32x4_t k, step, thr, d, wrap;
+	size_t i;
+
+	if (len < 4 || threshold > VEC_MAX_THR) {
+		ra_ref_scalar(data, len, op, threshold, pos);
+		return;
+	}
+
+	ra_ref_first_keys(first, 4, threshold, pos);
+	k = vld1q_u32(first);
+	step = vdupq_n_u32(4 % threshold);
+	thr = vdupq_n_u32(threshold);
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		d = vld1q_u32(d32 + i);
+		if (op == RA_OP_ENCRYPT)
+			d = vaddq_u32(d, k);
+		else
+			d = vsubq_u32(d, k);
+		vst1q_u32(d32 + i, d);
+
+		k = vaddq_u32(k, step);
+		wrap = vcgtq_u32(k, thr);
+		k = vsubq_u32(k, vandq_u32(wrap, thr));
+	}
+
+	ra_ref_scalar(data + i, len - i, op, threshold, pos + i);
+}
+#endif /* RA_REF_NEON */
+
+ra_ref_fn ra_ref_get(char const *name)
+{
+	if (name == NULL)
+		return ra_ref_get(ra_ref_best_name());
+
+	if (strcmp(name, "scalar") == 0)
+		return ra_ref_scalar;
+#ifdef RA_REF_X86
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2"))
+		return ra_ref_sse2;
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+		return ra_ref_avx2;
+#endif
+#ifdef RA_REF_NEON
+	if (strcmp(name, "neon") == 0)
+		return ra_ref_neon;
+#endif
+	return NULL;
+}
+
+char const *ra_ref_best_name(void)
+{
+#ifdef RA_REF_X86
+	if (__builtin_cpu_supports("avx2"))
+		return "avx2";
+	if (__builtin_cpu_supports("sse2"))
+		return "sse2";
+#endif
+#ifdef RA_REF_NEON
+	return "neon";
+#endif
+	return "scalar";
+}
+
+void ra_ref_process(int *data, size_t len, int op, unsigned int threshold,
+		    uint64_t pos)
+{
+	/* Resolved once: the CPU does not change while we run. */
+	static ra_ref_fn best;
+
+	if (best == NULL)
+		best = ra_ref_get(NULL);
+	best(data, len, op, threshold, pos);
+}
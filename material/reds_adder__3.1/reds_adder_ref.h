@@ -0,0 +1,60 @@
+/*
+ * Reference implementation of the REDS-adder, in user space.
+ * v3.1
+ *
+ * The counter of the REDS-adder goes through 1, 2, ..., threshold and starts
+ * over, and the driver adds (encrypt) or subtracts (decrypt) its values to the
+ * integers of a vector. The integer at position 'pos' of the stream of an open
+ * file (counting every integer read from it before) is therefore transformed
+ * with (pos % threshold) + 1, whatever the device it went through.
+ *
+ * This library computes exactly what a read() of the driver returns. It can be
+ * used instead of the device when it is busy, and as an oracle to check the
+ * driver (see fuzz_v3.c). The add/sub is vectorised with SSE2 or AVX2 on x86
+ * and with NEON on ARM; the best implementation supported by the CPU is picked
+ * at run time.
+ */
+#ifndef REDS_ADDER_REF_H
+#define REDS_ADDER_REF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Encrypt/decrypt a vector in place.
+ *
+ * @param data: vector to encrypt/decrypt
+ * @param len: number of integers in the vector
+ * @param op: RA_OP_ENCRYPT or RA_OP_DECRYPT
+ * @param threshold: threshold of the device (> 0)
+ * @param pos: position of the first integer in the stream
+ */
+typedef void (*ra_ref_fn)(int *data, size_t len, int op,
+			  unsigned int threshold, uint64_t pos);
+
+/**
+ * @brief Encrypt/decrypt a vector in place, with the best implementation.
+ *
+ * The arguments are the ones of ra_ref_fn.
+ */
+void ra_ref_process(int *data, size_t len, int op, unsigned int threshold,
+		    uint64_t pos);
+
+/**
+ * @brief Get a given implementation.
+ *
+ * @param name: "scalar", "sse2", "avx2" or "neon", NULL for the best one
+ *
+ * @return: the implementation, or NULL if it is not available on this CPU
+ * (or has not been built in).
+ */
+ra_ref_fn ra_ref_get(char const *name);
+
+/**
+ * @brief Name of the implementation used by ra_ref_process().
+ *
+ * @return: one of the names accepted by ra_ref_get().
+ */
+char const *ra_ref_best_name(void);
+
+#endif /* REDS_ADDER_REF_H */
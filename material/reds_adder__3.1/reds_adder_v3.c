@@ -27,6 +27,33 @@
 #include <linux/cdev.h>
 #include <linux/mutex.h>
 #include <linux/kfifo.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/uio.h>
+#include <linux/scatterlist.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/atomic.h>
+#include <linux/property.h>
+#include <linux/idr.h>
+#include <linux/seqlock.h>
+#include <asm/unaligned.h>
+#include <crypto/engine.h>
+#include <crypto/internal/skcipher.h>
+
+#include "reds_adder_v3.h"
+#include "reds_adder_emu.h"
+
+/* Only one file of the module must create the trace events. */
+#define CREATE_TRACE_POINTS
+#include "reds_adder_v3_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("REDS");
@@ -73,12 +100,192 @@ MODULE_DESCRIPTION("REDS-adder driver v3.1");
 
 /* Name of the device. */
 #define DEV_NAME "reds-adder"
+/* Name of the device file spreading the work over all the devices. */
+#define POOL_NAME "reds-adder-pool"
 
 /*
- * Maximum length of a vector to encrypt/decrypt.
- * Since we're going to use a KFIFO, this MUST be a power of 2.
+ * Maximum number of REDS-adders handled by the driver. Minors 0 to
+ * MAX_DEVICES - 1 go to the devices, minor MAX_DEVICES to the pool.
  */
-#define MAX_VEC_LEN 256
+#define MAX_DEVICES 16
+
+/* The pool splits the vectors in pieces of at most this many integers. */
+#define POOL_PIECE_LEN 256
+
+/* Number of requests the crypto engine queues before refusing new ones. */
+#define CRYPTO_QUEUE_LEN 256
+
+/*
+ * Default and maximum size (in bytes) of the KFIFO of each open file, i.e. how
+ * much data can be queued before the writers block. read()s and write()s are
+ * not limited by it. Since we're going to use a KFIFO, the size is rounded up
+ * to a power of 2.
+ */
+#define DEFAULT_FIFO_SIZE 4096
+#define MAX_FIFO_SIZE (1 << 20)
+
+static unsigned int fifo_size = DEFAULT_FIFO_SIZE;
+module_param(fifo_size, uint, 0444);
+MODULE_PARM_DESC(fifo_size,
+		 "Size in bytes of the queue of each open file (power of 2), unless given by the DT");
+
+/*
+ * Number of integer slots in the ring shared with user space through mmap().
+ * The indices of the ring are free-running, so this MUST be a power of 2.
+ */
+#define RING_ENTRIES 16384
+/* Size of the whole shared ring: one page for the header, then the slots. */
+#define RING_SIZE (PAGE_SIZE + PAGE_ALIGN(RING_ENTRIES * sizeof(int)))
+
+/*
+ * How long the engine waits for the threshold interrupt before giving up and
+ * resetting the counter by itself (in milliseconds).
+ */
+#define IRQ_TIMEOUT_MS 10
+
+/* Maximum number of memory segments making up a single request. */
+#define REQ_MAX_SEGS 2
+
+/* By default, check one value out of 64 against the hardware in fast mode. */
+#define DEFAULT_FAST_SAMPLE 64
+
+/*
+ * By default, the engine processes at most this many values of a context before
+ * moving on to the next one (see ra_engine_next()).
+ */
+#define DEFAULT_SLICE 16
+
+/* Buckets of the read latency histogram: [2^i, 2^(i+1)) ns, the last is open. */
+#define LAT_BUCKETS 32
+
+/**
+ * @struct ra_seg
+ * @brief A contiguous piece of a vector to encrypt/decrypt.
+ *
+ * @var ra_seg::data
+ * First value of the segment (processed in place).
+ * @var ra_seg::len
+ * Number of values in the segment.
+ */
+struct ra_seg {
+	int *data;
+	size_t len;
+};
+
+/**
+ * @struct ra_config
+ * @brief Configuration selected through sysfs.
+ *
+ * Every change gives a new version of the configuration. A request captures
+ * the version current when it is built and is entirely processed with it, so
+ * that a change never affects a request already submitted.
+ *
+ * @var ra_config::version
+ * Number of changes made so far.
+ * @var ra_config::threshold
+ * Encryption/decryption threshold.
+ * @var ra_config::encrypt
+ * Operation (encrypt when true, decrypt when false), used by the contexts that
+ * did not choose their own.
+ * @var ra_config::fast
+ * Mode: compute the counter's values in software when true, read them from the
+ * hardware when false.
+ * @var ra_config::fast_sample
+ * In fast mode, one value out of 'fast_sample' is checked against the hardware
+ * (never when 0).
+ */
+struct ra_config {
+	u64 version;
+	int threshold;
+	bool encrypt;
+	bool fast;
+	u32 fast_sample;
+};
+
+/**
+ * @struct ra_req
+ * @brief A vector submitted to the hardware engine.
+ *
+ * The segments of a request are processed one after the other as a single
+ * vector, starting at position 'pos' of the counter's sequence. The
+ * configuration is captured when the request is built, so that later changes
+ * through sysfs do not affect a request already submitted.
+ *
+ * @var ra_req::node
+ * Entry in the list of pending requests of its context.
+ * @var ra_req::done
+ * Completed by the engine once the request has been processed.
+ * @var ra_req::status
+ * 0 once processed, a negative error code if the request was dropped.
+ * @var ra_req::encrypt
+ * Operation to perform (encrypt when true, decrypt when false).
+ * @var ra_req::threshold
+ * Threshold to program in the device before processing the request.
+ * @var ra_req::fast
+ * Compute the counter's values instead of reading them (fast mode).
+ * @var ra_req::sample
+ * In fast mode, check one value out of 'sample' against the hardware (never
+ * when 0).
+ * @var ra_req::version
+ * Version of the configuration the request was built with.
+ * @var ra_req::pos
+ * Position in the counter's sequence of the first value of the vector.
+ * @var ra_req::progress
+ * Number of values already processed (only touched by the engine).
+ * @var ra_req::nr_segs
+ * Number of valid entries in 'segs'.
+ * @var ra_req::segs
+ * Memory segments making up the vector.
+ * @var ra_req::buf
+ * Optional storage for the vector, when the submitter needs a private copy.
+ * @var ra_req::end
+ * Called by the engine once the request has been processed, instead of
+ * completing 'done' (for the submitters that do not sleep, NULL otherwise).
+ * @var ra_req::owner
+ * Submitter's data, for 'end'.
+ */
+struct ra_req {
+	struct list_head node;
+	struct completion done;
+	int status;
+	void (*end)(struct ra_req *req);
+	void *owner;
+
+	bool encrypt;
+	int threshold;
+	bool fast;
+	u32 sample;
+	u64 version;
+	u64 pos;
+	size_t progress;
+
+	unsigned int nr_segs;
+	struct ra_seg segs[REQ_MAX_SEGS];
+	int buf[];
+};
+
+/**
+ * @struct ra_stats
+ * @brief Statistics exposed in debugfs.
+ *
+ * All the counters can be reset by writing to their debugfs file.
+ *
+ * @var ra_stats::irqs
+ * Number of interrupts received.
+ * @var ra_stats::bytes
+ * Number of bytes processed by the engine.
+ * @var ra_stats::mutex_wait_ns
+ * Total time spent waiting for the read/write mutexes of the contexts, in ns
+ * (this includes the time a reader holding the mutex waits for data).
+ * @var ra_stats::lat_hist
+ * Histogram of the read() latencies, bucket 'i' counts [2^i, 2^(i+1)) ns.
+ */
+struct ra_stats {
+	atomic64_t irqs;
+	atomic64_t bytes;
+	atomic64_t mutex_wait_ns;
+	atomic64_t lat_hist[LAT_BUCKETS];
+};
 
 /**
  * @struct priv
@@ -90,56 +297,244 @@ MODULE_DESCRIPTION("REDS-adder driver v3.1");
  *
  * @var priv::MEM_ptr
  * Pointer to the ioremap()ed memory.
+ * @var priv::emu
+ * Register accessors of the emulated device, NULL on real hardware.
  * @var priv::IRQ_num
  * IRQ number, retrieved from the DT.
  * @var priv::dev
  * Pointer to our device (will be useful when printing out messages).
  * @var priv::dev_num
  * Major number for our device in /dev.
- * @var priv::dev_class
- * This device family's class.
  * @var priv::cdev
  * Character device associated with the REDS-adder.
  * @var priv::dev_file
  * Pointer to the created device file.
- * @var priv::threshold
- * Encryption/decryption threshold in use.
- * @var priv::encrypt
- * Operation currently selected (encrypt when true, decrypt when false).
- * @var priv::read_mutex
- * Mutex protecting read() operations from changes to operation and threshold.
- * @var priv::read_queue
- * Wait queue used to have a read() that can block.
- * @var priv::data_fifo
- * KFIFO where the data to be encrypted/decrypted will be stored.
- * @var priv::tmp_buf
- * Temporary buffer used for encryption/decryption.
+ * @var priv::fifo_size
+ * Size in bytes of the KFIFO of each context.
+ * @var priv::config
+ * Configuration selected through sysfs.
+ * @var priv::config_lock
+ * Sequence lock protecting 'config': changes never wait for (nor fail because
+ * of) the requests capturing it, the requests retry if a change was made
+ * meanwhile.
+ * @var priv::slice
+ * Number of values of a context the engine processes before moving on to the
+ * next one.
+ * @var priv::engine
+ * Kernel thread feeding the requests to the hardware.
+ * @var priv::engine_queue
+ * Wait queue where the engine sleeps while there is nothing to do.
+ * @var priv::req_lock
+ * Spinlock protecting the list of active contexts and their pending requests.
+ * @var priv::active_list
+ * Contexts with pending requests, served in a round-robin fashion.
+ * @var priv::dead
+ * Set under 'req_lock' when the device is removed: the requests pushed
+ * afterwards are failed with -ENODEV instead of being queued.
+ * @var priv::irq_done
+ * Completed by the IRQ handler once the counter has been reset.
+ * @var priv::hw_threshold
+ * Threshold currently programmed in the device (only touched by the engine).
+ * @var priv::hw_pos
+ * Number of values given by the counter since it was last reset (only touched
+ * by the engine).
+ * @var priv::fast_credit
+ * Number of values to compute in fast mode before the next check against the
+ * hardware (only touched by the engine).
+ * @var priv::fast_diverged
+ * Set by the engine when the hardware disagreed with a computed value: fast
+ * mode is then suspended until it is selected again through sysfs.
+ * @var priv::stats
+ * Statistics exposed in debugfs.
+ * @var priv::debugfs
+ * Our debugfs directory.
+ * @var priv::pool
+ * True for the pool's private data (no hardware behind it, see 'struct
+ * ra_pool').
+ * @var priv::minor
+ * Minor number of the device file.
+ * @var priv::pool_node
+ * Entry in the pool's list of devices.
+ * @var priv::load
+ * Number of values queued in the engine and not processed yet.
+ * @var priv::kobj
+ * Reference count of a device's private data (never added to sysfs). The
+ * device holds a reference until it is removed, the cdev another one until
+ * the last file opened through it is closed: a file can outlive its device.
  */
 struct priv {
 	void *MEM_ptr;
+	const struct ra_emu_ops *emu;
 	int IRQ_num;
 	struct device *dev;
 
 	dev_t dev_num;
-	struct class *dev_class;
 	struct cdev cdev;
 	struct device *dev_file;
 
-	int threshold;
-	bool encrypt;
+	unsigned int fifo_size;
+	struct ra_config config;
+	seqlock_t config_lock;
+	u32 slice;
+
+	struct task_struct *engine;
+	wait_queue_head_t engine_queue;
+	spinlock_t req_lock;
+	struct list_head active_list;
+	bool dead;
+	struct completion irq_done;
+	int hw_threshold;
+	u32 hw_pos;
+	u32 fast_credit;
+	bool fast_diverged;
+
+	struct ra_stats stats;
+	struct dentry *debugfs;
+
+	bool pool;
+	unsigned int minor;
+	struct list_head pool_node;
+	atomic_t load;
+	struct kobject kobj;
+};
+
+/**
+ * @struct ra_queue
+ * @brief Requests waiting for the engine of a device, on behalf of a context.
+ *
+ * This is what the engine serves in a round-robin fashion. A context of a
+ * device has a single queue, a context of the pool has one queue per device,
+ * since its requests are spread over all of them.
+ *
+ * @var ra_queue::priv
+ * Private data of the device whose engine processes the requests.
+ * @var ra_queue::req_list
+ * Requests waiting for the engine, in submission order.
+ * @var ra_queue::active_node
+ * Entry in the engine's list of active queues (empty when not in it).
+ * @var ra_queue::deficit
+ * Number of values the engine can still process for this queue before moving
+ * on to the next one, 0 when its turn is over (only touched under the engine's
+ * 'req_lock').
+ */
+struct ra_queue {
+	struct priv *priv;
+	struct list_head req_list;
+	struct list_head active_node;
+	size_t deficit;
+};
+
+/**
+ * @struct ra_ctx
+ * @brief Per-open context.
+ *
+ * Each open() of the device file gets its own context, so that several
+ * processes can use the same device without mixing up their data.
+ *
+ * @var ra_ctx::priv
+ * Pointer to driver's private data.
+ * @var ra_ctx::op
+ * Operation selected with RA_IOC_SET_OP (RA_OP_DEVICE to follow sysfs).
+ * @var ra_ctx::read_mutex
+ * Mutex serializing the read()s (the KFIFO has a single consumer).
+ * @var ra_ctx::write_mutex
+ * Mutex serializing the write()s (the KFIFO has a single producer).
+ * @var ra_ctx::read_queue
+ * Wait queue used to have a read() that can block.
+ * @var ra_ctx::write_queue
+ * Wait queue woken up when room is made in the KFIFO.
+ * @var ra_ctx::data_fifo
+ * KFIFO where the data to be encrypted/decrypted will be stored.
+ * @var ra_ctx::seq_pos
+ * Position in the counter's sequence of the next value read().
+ * @var ra_ctx::ring
+ * Ring shared with user space through mmap() (vmalloc()ed memory, allocated
+ * on the first mmap()).
+ * @var ra_ctx::ring_done
+ * Driver's copy of the ring's 'done' index (user space can scribble on the
+ * shared one, we never trust it).
+ * @var ra_ctx::ring_pos
+ * Position in the counter's sequence of the slot at 'ring_done': the stream
+ * goes on when the 32-bit indices wrap around.
+ * @var ra_ctx::ring_mutex
+ * Mutex protecting the allocation of the ring and serializing its doorbells.
+ * @var ra_ctx::queue
+ * Requests of this context waiting for the engine (device's contexts only).
+ * @var ra_ctx::lanes
+ * One queue per device, indexed by minor number (pool's contexts only, NULL
+ * otherwise).
+ */
+struct ra_ctx {
+	struct priv *priv;
+	int op;
+
 	struct mutex read_mutex;
+	struct mutex write_mutex;
 	wait_queue_head_t read_queue;
+	wait_queue_head_t write_queue;
 	struct kfifo data_fifo;
-	int tmp_buf[MAX_VEC_LEN];
+	u64 seq_pos;
+
+	struct ra_ring_hdr *ring;
+	u32 ring_done;
+	u64 ring_pos;
+	struct mutex ring_mutex;
+
+	struct ra_queue queue;
+	struct ra_queue *lanes;
+};
+
+/**
+ * @struct ra_pool
+ * @brief State shared by all the REDS-adders handled by the driver.
+ *
+ * All the devices share a class and a range of minor numbers, which are set up
+ * once, when the module is loaded. They are also gathered in a pool, which has
+ * its own device file: the vectors submitted to it are spread over the devices
+ * (the least loaded first), and the results come back in order. The pool has
+ * its private data too, to hold its configuration (sysfs attributes) and the
+ * statistics of its files, but no engine.
+ *
+ * This is state of the module, not of a device, so it cannot live in the
+ * private data of a device.
+ *
+ * @var ra_pool::devt
+ * First major/minor number pair of the range.
+ * @var ra_pool::class
+ * Class of all the device files (/sys/class/ra).
+ * @var ra_pool::minors
+ * Allocator of the devices' minor numbers.
+ * @var ra_pool::lock
+ * Mutex protecting the list of devices, held while requests are dispatched.
+ * @var ra_pool::devices
+ * Devices available, the next one to use for a given load first.
+ * @var ra_pool::priv
+ * Pool's private data.
+ */
+struct ra_pool {
+	dev_t devt;
+	struct class *class;
+	struct ida minors;
+	struct mutex lock;
+	struct list_head devices;
+	struct priv *priv;
+};
+
+static struct ra_pool ra_pool = {
+	.minors = IDA_INIT(ra_pool.minors),
+	.lock = __MUTEX_INITIALIZER(ra_pool.lock),
+	.devices = LIST_HEAD_INIT(ra_pool.devices),
 };
 
 /* Prototypes for the functions that operate on files. */
-static ssize_t ra_file_read(struct file *filp, char __user *buf, size_t count,
-			    loff_t *ppos);
-static ssize_t ra_file_write(struct file *filp, const char __user *buf,
-			     size_t count, loff_t *ppos);
+static ssize_t ra_file_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t ra_file_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static int ra_file_open(struct inode *inode, struct file *filp);
 static int ra_file_release(struct inode *inode, struct file *filp);
+static int ra_file_mmap(struct file *filp, struct vm_area_struct *vma);
+static __poll_t ra_file_poll(struct file *filp, poll_table *wait);
+static long ra_file_ioctl(struct file *filp, unsigned int cmd,
+			  unsigned long arg);
 
 /*
  * This is the list of functions relative to the file operations we perform in our
@@ -152,8 +547,22 @@ static const struct file_operations ra_fops = {
 	.owner = THIS_MODULE,
 	.open = ra_file_open,
 	.release = ra_file_release, /* This is the file close() */
-	.read = ra_file_read,
-	.write = ra_file_write,
+	/*
+	 * The _iter() variants are used for read()/write() as well as for
+	 * readv()/writev(): a whole I/O vector is a single request.
+	 */
+	.read_iter = ra_file_read_iter,
+	.write_iter = ra_file_write_iter,
+	/*
+	 * splice()/sendfile() move pages of a pipe in and out of the device
+	 * without going through user space: both rely on the _iter() variants.
+	 */
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.mmap = ra_file_mmap,
+	.poll = ra_file_poll,
+	.unlocked_ioctl = ra_file_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
 /* Prototypes for sysfs functions. */
@@ -169,6 +578,19 @@ static ssize_t store_threshold(struct device *dev,
 			       size_t count);
 static ssize_t show_threshold(struct device *dev, struct device_attribute *attr,
 			      char *buf);
+static ssize_t store_mode(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count);
+static ssize_t show_mode(struct device *dev, struct device_attribute *attr,
+			 char *buf);
+static ssize_t store_fast_sample(struct device *dev,
+				 struct device_attribute *attr, const char *buf,
+				 size_t count);
+static ssize_t show_fast_sample(struct device *dev,
+				struct device_attribute *attr, char *buf);
+static ssize_t store_slice(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count);
+static ssize_t show_slice(struct device *dev, struct device_attribute *attr,
+			  char *buf);
 
 /*
  * Declare a sysfs file, read-only, that allows the user to see the maximum length
@@ -185,6 +607,21 @@ static DEVICE_ATTR(operation, 0600, show_operation, store_operation);
  * encryption/decryption process.
  */
 static DEVICE_ATTR(threshold, 0600, show_threshold, store_threshold);
+/*
+ * Declare a sysfs file that allows to see (and change) how the counter's values
+ * are obtained: read from the device ("hardware") or computed ("fast").
+ */
+static DEVICE_ATTR(mode, 0600, show_mode, store_mode);
+/*
+ * Declare a sysfs file that allows to see (and set) how often a computed value
+ * is checked against the device in fast mode.
+ */
+static DEVICE_ATTR(fast_sample, 0600, show_fast_sample, store_fast_sample);
+/*
+ * Declare a sysfs file that allows to see (and set) how many values of a context
+ * are processed before the next context gets the device.
+ */
+static DEVICE_ATTR(slice, 0600, show_slice, store_slice);
 
 /* Group these sysfs attributes in a single sysfs group */
 static struct attribute *ra_device_attrs[] = {
@@ -195,6 +632,12 @@ static struct attribute *ra_device_attrs[] = {
 	&dev_attr_operation.attr,
 	/* Encryption/decryption threshold. */
 	&dev_attr_threshold.attr,
+	/* Choose between the hardware and the fast mode. */
+	&dev_attr_mode.attr,
+	/* Sampling of the fast mode's values. */
+	&dev_attr_fast_sample.attr,
+	/* Per-context budget of the engine. */
+	&dev_attr_slice.attr,
 	NULL,
 };
 
@@ -242,7 +685,11 @@ static int ra_read(struct priv const *const priv, int const reg_offset)
 	 * call a ra_read() before having a valid pointer to the mapped registers.
 	 */
 	WARN_ON(priv == NULL);
-	WARN_ON(priv->MEM_ptr == NULL);
+	WARN_ON(priv->MEM_ptr == NULL && priv->emu == NULL);
+
+	/* The emulator is not memory-mapped, it gives us its own accessors. */
+	if (priv->emu)
+		return priv->emu->read(priv->emu->emu, reg_offset);
 
 	/*
 	 * As discussed above, the casting on 'priv->MEM_ptr' is important. If you
@@ -268,7 +715,12 @@ static void ra_write(struct priv const *const priv, int const reg_offset,
 	 * registers.
 	 */
 	WARN_ON(priv == NULL);
-	WARN_ON(priv->MEM_ptr == NULL);
+	WARN_ON(priv->MEM_ptr == NULL && priv->emu == NULL);
+
+	if (priv->emu) {
+		priv->emu->write(priv->emu->emu, reg_offset, value);
+		return;
+	}
 
 	/*
 	 * As discussed above, the casting on 'priv->MEM_ptr' is important. If you
@@ -278,325 +730,1545 @@ static void ra_write(struct priv const *const priv, int const reg_offset,
 }
 
 /**
- * @brief Initialization of the device file.
+ * @brief Wait for the interrupt that resets the counter at the threshold.
  *
- * The encryption/decryption process must start from a known state, therefore we
- * reset the internal counter.
- *
- * @param inode: structure used by the kernel to hold file information
- * @param filp: higher-level file description, that tracks the current cursor
- * position, thus used when the file is actually open.
+ * This replaces the udelay() we used to perform after each read of the
+ * counter: instead of spinning for a whole millisecond on every value, the
+ * engine only sleeps when the counter actually reached the threshold, and it
+ * is woken up by the IRQ handler as soon as the counter is reset.
  *
- * @return: 0.
+ * @param priv: pointer to driver's private data
  */
-static int ra_file_open(struct inode *inode, struct file *filp)
+static void ra_wait_irq(struct priv *priv)
 {
-	/*
-	 * Retrieve the pointer to the private data embedded into the 'inode'
-	 * structure using the 'container_of' macro.
-	 * More info on this macro here:
-	 * https://www.linuxjournal.com/files/linuxjournal.com/linuxjournal/articles/067/6717/6717s2.html
-	 */
-	struct priv *priv = container_of(inode->i_cdev, struct priv, cdev);
-	/*
-	 * Store the pointer to the private data in the 'file' structure for later
-	 * use.
-	 */
-	filp->private_data = priv;
-
-	/* Reset the counter used by the encryption/decryption process. */
-	ra_write(priv, INIT_REG_OFF, REINIT_CNT);
-
-	/*
-	 * Since the device file we created does not support lseek(), we have to
-	 * do this (instead of simply returning 0.
-	 */
-	return nonseekable_open(inode, filp);
+	if (!wait_for_completion_timeout(&priv->irq_done,
+					 msecs_to_jiffies(IRQ_TIMEOUT_MS))) {
+		/* No interrupt (yet?), reset the counter ourselves. */
+		dev_warn_ratelimited(priv->dev,
+				     "engine: threshold interrupt missed !\n");
+		ra_write(priv, INIT_REG_OFF, REINIT_CNT);
+	}
+	priv->hw_pos = 0;
 }
 
 /**
- * @brief Function called after a file close() is requested by the user.
-
- * @param inode: structure used by the kernel to hold file information
- * @param filp: higher-level file description, that tracks the current cursor
- * position, thus used when the file is actually open.
-
- * @return: 0.
+ * @brief Read the next value of the counter.
+ *
+ * Only called by the engine. If the value reaches the threshold, we also wait
+ * for the interrupt that resets the counter.
+ *
+ * @param priv: pointer to driver's private data
+ * @param threshold: threshold programmed in the device
+ *
+ * @return: the value given by the counter.
  */
-static int ra_file_release(struct inode *inode, struct file *filp)
+static int ra_next_value(struct priv *priv, int threshold)
 {
+	int value;
+
 	/*
-	 * Invalidate the pointer stored in the 'file' structure.
+	 * Rearm the completion BEFORE reading: the interrupt is raised by the
+	 * very read that makes the counter reach the threshold.
 	 */
-	filp->private_data = NULL;
+	reinit_completion(&priv->irq_done);
+	value = ra_read(priv, VALUE_REG_OFF);
 
-	return 0;
+	if (value >= threshold)
+		ra_wait_irq(priv);
+	else
+		priv->hw_pos = value;
+
+	return value;
 }
 
 /**
- * @brief Retrieve an "encrypted/decrypted" vector from the device.
+ * @brief Encrypt/decrypt a vector in place using the REDS-adder.
  *
- * Partial reads are allowed -- but will have a weird effect! Can you spot why?
- * (this is a potential bug or a feature, as it could add another "security"
- * measure in our device).
- * Analyze the problem and try to give a solution to this issue!
+ * Only called by the engine. The caller is in charge of resetting the counter
+ * before the first value of a vector: this lets a vector that is not
+ * contiguous in memory (e.g., wrapping around the shared ring) be processed in
+ * several calls.
  *
- * If more data is requested than that currently in the KFIFO, the read() will
- * block until enough data is given.
+ * @param priv: pointer to driver's private data
+ * @param data: vector to encrypt/decrypt
+ * @param len: number of integers in the vector
+ * @param encrypt: encrypt when true, decrypt when false
+ * @param threshold: threshold programmed in the device
+ */
+static void ra_process(struct priv *priv, int *data, size_t len, bool encrypt,
+		       int threshold)
+{
+	size_t i;
+	int value;
+
+	for (i = 0; i < len; ++i) {
+		value = ra_next_value(priv, threshold);
+		if (encrypt)
+			data[i] += value;
+		else
+			data[i] -= value;
+	}
+}
+
+/**
+ * @brief Bring the counter to a given position of its sequence.
  *
- * @param filp: pointer to the file descriptor in use
- * @param buf: data buffer used to discuss with the user space
- * @param count: size of the transfer requested
- * @param ppos: start position from which data should be read (ignored)
+ * The counter goes through 1, 2, ..., threshold and starts over, so the value
+ * it gives only depends on the position modulo the threshold: we consume the
+ * values up to the wanted position (resetting the counter first if it is
+ * already past it). None of these reads reaches the threshold, so no interrupt
+ * is involved. A context reading a stream usually finds the counter exactly
+ * where it left it, and then nothing has to be done at all.
  *
- * @return: Number of bytes read from the internal KFIFO, or a negative error
- * code if an error occurred.
+ * @param priv: pointer to driver's private data
+ * @param pos: position (number of values already processed)
+ * @param threshold: threshold programmed in the device
  */
-static ssize_t ra_file_read(struct file *filp, char __user *buf, size_t count,
-			    loff_t *ppos)
+static void ra_seek(struct priv *priv, u64 pos, int threshold)
 {
-	/*
-	 * Retrieve the pointer to our private data.
-	 */
-	struct priv *priv = filp->private_data;
-
-	/*
-	 * Counter used to iterate over the data while encrypting/decrypting it.
-	 */
-	int i;
+	u32 const target = do_div(pos, threshold);
 
-	/*
-	 * To simplify our life, if the user asks for more than our KFIFO can
-	 * hold, we simply reject its request.
-	 */
-	if (count > MAX_VEC_LEN) {
-		dev_err(priv->dev,
-			"read(): cannot ask for more than buffer size !\n");
-		return 0;
+	if (target < priv->hw_pos) {
+		ra_write(priv, INIT_REG_OFF, REINIT_CNT);
+		priv->hw_pos = 0;
 	}
+	for (; priv->hw_pos < target; ++priv->hw_pos)
+		ra_read(priv, VALUE_REG_OFF);
+}
 
-	/*
-	 * Since we operate on integers, we expect that the user asks for a number
-	 * of bytes that is a multiple of the size of an integer.
-	 */
-	if (count % sizeof(int) != 0) {
-		dev_err(priv->dev,
-			"read(): the device operates on integers !\n");
-		return 0;
+/**
+ * @brief Encrypt/decrypt a vector in place, computing the counter's values.
+ *
+ * The counter gives 1, 2, ..., threshold and starts over, so the value at any
+ * position of its sequence is known in advance. The vector is processed one
+ * period of the counter at a time: within a period, the values are consecutive
+ * integers and the loop has no dependency between its iterations, which the
+ * compiler turns into straight-line adds/subs. No register is accessed.
+ *
+ * @param data: vector to encrypt/decrypt
+ * @param len: number of integers in the vector
+ * @param encrypt: encrypt when true, decrypt when false
+ * @param threshold: threshold of the sequence
+ * @param phase: position of the first value in the counter's period
+ *
+ * @return: position in the counter's period after the vector.
+ */
+static u32 ra_fast_apply(int *data, size_t len, bool encrypt, u32 threshold,
+			 u32 phase)
+{
+	size_t i = 0;
+	size_t run;
+	size_t j;
+
+	while (i < len) {
+		run = min_t(size_t, len - i, threshold - phase);
+		if (encrypt) {
+			for (j = 0; j < run; ++j)
+				data[i + j] += phase + 1 + j;
+		} else {
+			for (j = 0; j < run; ++j)
+				data[i + j] -= phase + 1 + j;
+		}
+		i += run;
+		phase += run;
+		if (phase == threshold)
+			phase = 0;
 	}
 
-	/* First thing, acquire the lock that prevent conflicts with sysfs. */
-	mutex_lock(&priv->read_mutex);
+	return phase;
+}
 
-	if (count > kfifo_len(&(priv->data_fifo))) {
-		/*
-		 * Here the user is trying to read more than what we have in
-		 * store, we have to sleep until its request can be satisfied...
-		 */
-		wait_event_interruptible(priv->read_queue,
-					 kfifo_len(&(priv->data_fifo)) >=
-						 count);
-		dev_dbg(priv->dev, "read(): received wake up!\n");
+/**
+ * @brief Run a request in fast mode.
+ *
+ * The whole vector is computed in software, then some of its values are read
+ * from the hardware to make sure that the device still behaves as we think it
+ * does (one value out of 'req->sample', counting across requests). If the
+ * device disagrees, the vector is restored, fast mode is suspended and the
+ * caller has to process the request through the hardware.
+ *
+ * @param priv: pointer to driver's private data
+ * @param req: request to process
+ *
+ * @return: true if the request has been processed, false otherwise.
+ */
+static bool ra_fast_run(struct priv *priv, struct ra_req *req)
+{
+	u32 const threshold = req->threshold;
+	u64 pos = req->pos;
+	u32 const first = do_div(pos, threshold);
+	u32 phase = first;
+	size_t len = 0;
+	size_t k;
+	unsigned int i;
+	int value;
+
+	for (i = 0; i < req->nr_segs; ++i) {
+		phase = ra_fast_apply(req->segs[i].data, req->segs[i].len,
+				      req->encrypt, threshold, phase);
+		len += req->segs[i].len;
 	}
 
-	/*
-	 * Instead of operating on a value at a time, we dump all the interesting
-	 * KFIFO content in a temporary buffer, and then encrypt/decrypt on the
-	 * go.
-	 */
-	/* Transfer all the data we are interested in the buffer. */
-	if (kfifo_out(&priv->data_fifo, priv->tmp_buf, count) < count) {
-		mutex_unlock(&priv->read_mutex);
-		dev_err(priv->dev, "read(): missing data in kfifo_out() !\n");
-		return -EFAULT;
+	if (req->sample == 0)
+		return true;
+
+	for (k = min(priv->fast_credit, req->sample - 1); k < len;
+	     k += req->sample) {
+		ra_seek(priv, req->pos + k, threshold);
+		value = ra_next_value(priv, threshold);
+		if (value != (first + k) % threshold + 1)
+			goto diverged;
 	}
+	priv->fast_credit = k - len;
 
-	/* Reset the counter used by the encryption/decryption process. */
-	ra_write(priv, INIT_REG_OFF, REINIT_CNT);
+	return true;
 
-	/*
-	 * Perform the hardware-assisted encryption/decryption. This for loop will
-	 * trigger a set of interrupts each time we reach the threshold, resetting
-	 * each time the internal counter. For efficiency, we encrypt/decrypt only
-	 * the number of values requested by the user.
-	 */
-	if (priv->encrypt) {
-		for (i = 0; i < count / sizeof(int); ++i) {
-			priv->tmp_buf[i] += ra_read(priv, VALUE_REG_OFF);
-			/*
-			 * ??????????
-			 * A bit of black magic happens here...
-			 * Try removing the delay below and check what happens.
-			 * You might want to add some fprintf()s to the test C
-			 * code to help you in figuring out what happens...
-			 */
-			udelay(1000);
-		}
-	} else {
-		for (i = 0; i < count / sizeof(int); ++i) {
-			priv->tmp_buf[i] -= ra_read(priv, VALUE_REG_OFF);
-			/*
-			 * ??????????
-			 * A bit of black magic happens here...
-			 * Try removing the delay below and check what happens.
-			 * You might want to add some fprintf()s to the test C
-			 * code to help you in figuring out what happens...
-			 */
-			udelay(1000);
-		}
-	}
+diverged:
+	dev_warn(priv->dev,
+		 "fast mode: device gave %d instead of %u, falling back to hardware !\n",
+		 value, (u32)((first + k) % threshold + 1));
+	WRITE_ONCE(priv->fast_diverged, true);
+	priv->fast_credit = 0;
 
-	/* Copy the data to the user. */
-	if (copy_to_user(buf, priv->tmp_buf, count) != 0) {
-		mutex_unlock(&priv->read_mutex);
-		dev_err(priv->dev,
-			"read(): error occurred in copy_to_user() operation !\n");
-		return -EFAULT;
-	}
+	/* Undo what we did, the vector is processed again by the hardware. */
+	phase = first;
+	for (i = 0; i < req->nr_segs; ++i)
+		phase = ra_fast_apply(req->segs[i].data, req->segs[i].len,
+				      !req->encrypt, threshold, phase);
 
-	mutex_unlock(&priv->read_mutex);
-	return count;
+	return false;
 }
 
 /**
- * @brief Store a vector to encode in the internal KFIFO.
+ * @brief Run a request through the hardware.
  *
- * @param filp: pointer to the file descriptor in use
- * @param buf: data buffer coming from user space
- * @param count: size of the transfer requested
- * @param ppos: start position from which data should be written (ignored)
+ * @param priv: pointer to driver's private data
+ * @param req: request to process
  *
- * @return: Number of bytes written in the internal KFIFO, or a negative error
- * code if an error occurred.
+ * @return: true if the request was computed in fast mode, false otherwise.
  */
-static ssize_t ra_file_write(struct file *filp, const char __user *buf,
-			     size_t count, loff_t *ppos)
+static bool ra_engine_run(struct priv *priv, struct ra_req *req)
 {
-	/*
-	 * Retrieve the pointer to our private data.
-	 */
-	struct priv *priv = filp->private_data;
+	unsigned int i;
+
+	/* Configuration changes are applied between two requests only. */
+	if (req->threshold != priv->hw_threshold) {
+		ra_write(priv, THRESH_REG_OFF, req->threshold);
+		ra_write(priv, INIT_REG_OFF, REINIT_CNT);
+		priv->hw_threshold = req->threshold;
+		priv->hw_pos = 0;
+	}
 
-	int rc;
+	if (req->fast && !READ_ONCE(priv->fast_diverged) &&
+	    ra_fast_run(priv, req))
+		return true;
 
 	/*
-	 * Since we operate on integers, we expect that the user offers a number
-	 * of bytes that is a multiple of the size of an integer.
+	 * The counter is shared by all the contexts, bring it where this
+	 * request's vector starts.
 	 */
-	if (count % sizeof(int) != 0) {
-		dev_err(priv->dev,
-			"write(): the device operates on integers !\n");
-		return -EINVAL;
-	}
+	ra_seek(priv, req->pos, req->threshold);
 
-	/*
-	 * Check that we are not trying to overflow our internal KFIFO.
-	 */
-	if (count > kfifo_avail(&priv->data_fifo)) {
-		dev_err(priv->dev,
-			"write(): overflow attempt on internal KFIFO !\n");
-		return -EINVAL;
-	}
+	for (i = 0; i < req->nr_segs; ++i)
+		ra_process(priv, req->segs[i].data, req->segs[i].len,
+			   req->encrypt, req->threshold);
 
-	/* Copy the data from the user into the KFIFO. */
-	if (kfifo_from_user(&priv->data_fifo, buf, count, &rc) != 0) {
-		dev_err(priv->dev,
-			"write(): error occurred in kfifo_from_user() operation !\n");
-		return -EFAULT;
-	}
+	return false;
+}
 
-	if (rc != count) {
-		dev_err(priv->dev,
-			"write(): missing data in kfifo_from_user() operation !\n");
-		return -EFAULT;
-	}
+/**
+ * @brief Number of values of a request.
+ *
+ * @param req: request
+ *
+ * @return: the sum of the lengths of its segments.
+ */
+static size_t ra_req_len(struct ra_req const *req)
+{
+	size_t len = 0;
+	unsigned int i;
 
-	/* Wake the read() up (if it was sleeping). */
-	wake_up_interruptible(&priv->read_queue);
+	for (i = 0; i < req->nr_segs; ++i)
+		len += req->segs[i].len;
 
-	return count;
+	return len;
 }
 
 /**
- * @brief Display the maximum length of an input message to encode/decode.
+ * @brief Process a slice of a request.
  *
- * This function is pretty useless, since the returned value is a constant.
- * However, it shows you that it is not mandatory to implement both the show() and
- * the store() operations -- please check the permissions on the corresponding
- * file in sysfs !
+ * The slice is described as a request of its own (same configuration, segments
+ * trimmed to the values of the slice), so that it is processed exactly like a
+ * whole request would be, through the hardware or in fast mode.
  *
- * @param dev: pointer to our device
- * @param attr: pointer to the associated attributes (ignored)
- * @param buf: output buffer (where data for the user will be put)
+ * @param priv: pointer to driver's private data
+ * @param req: request the slice belongs to
+ * @param len: number of values of the slice, starting at 'req->progress'
  *
- * @returns: number of bytes produced
+ * @return: true if the slice was computed in fast mode, false otherwise.
  */
-static ssize_t show_max_str_len(struct device *dev,
-				struct device_attribute *attr, char *buf)
+static bool ra_engine_slice(struct priv *priv, struct ra_req *req, size_t len)
 {
-	/*
-	 * Where does this 'PAGE_SIZE' constant come from? It's a symbol exported
-	 * by the kernel. It's important in this case, since sysfs' I/Os are
-	 * limited to a page.
-	 */
-	return snprintf(buf, PAGE_SIZE, "%d\n", MAX_VEC_LEN);
+	size_t skip = req->progress;
+	struct ra_req slice;
+	unsigned int i;
+	size_t n;
+
+	slice.encrypt = req->encrypt;
+	slice.threshold = req->threshold;
+	slice.fast = req->fast;
+	slice.sample = req->sample;
+	slice.version = req->version;
+	slice.pos = req->pos + req->progress;
+	slice.nr_segs = 0;
+
+	for (i = 0; i < req->nr_segs && len; ++i) {
+		if (skip >= req->segs[i].len) {
+			skip -= req->segs[i].len;
+			continue;
+		}
+		n = min(req->segs[i].len - skip, len);
+		slice.segs[slice.nr_segs].data = req->segs[i].data + skip;
+		slice.segs[slice.nr_segs].len = n;
+		slice.nr_segs++;
+		skip = 0;
+		len -= n;
+	}
+
+	return ra_engine_run(priv, &slice);
 }
 
 /**
- * @brief Change the operation performed by the device
- * ("encryption" <-> "decryption).
+ * @brief Choose what the engine processes next.
  *
- * Since this operation heavily impacts the encryption/decryption process, we
- * prevent the user from using it when a read() operation is in progress.
- * This is achieved thanks to a mutex that is acquired by the read() operation
- * when it starts, and not released until the operation is completed (warning: the
- * read might be put to sleep if the KFIFO does not contain enough samples -- to
- * avoid having a read on this sysfs entry stuck too, we use a trylock on the
- * mutex).
+ * The queues (i.e., the contexts) are served with a deficit round-robin: when
+ * its turn comes, a queue is given a budget of 'priv->slice' values, which its
+ * requests (in order) use up. A request larger than what is left is processed
+ * a slice at a time, over several turns. A context submitting a huge vector
+ * therefore only delays a context submitting a single value by one slice per
+ * active context, and both get the same share of the device.
  *
- * @param dev: pointer to our device
- * @param attr: pointer to the associated attributes (ignored)
- * @param buf: input buffer (where user input will show up)
- * @param count: number of bytes to read from the input buffer
+ * The queue stays at the head of the list (and the request in its queue) while
+ * the slice is processed: submitters only ever add requests at the tail.
  *
- * @returns: number of bytes processed
+ * @param priv: pointer to driver's private data
+ * @param qp: where to store the queue the request belongs to
+ * @param len: where to store the number of values of the slice
+ *
+ * @return: the request, or NULL if there is none.
+ */
+static struct ra_req *ra_engine_next(struct priv *priv, struct ra_queue **qp,
+				     size_t *len)
+{
+	struct ra_queue *q;
+	struct ra_req *req = NULL;
+
+	spin_lock(&priv->req_lock);
+	q = list_first_entry_or_null(&priv->active_list, struct ra_queue,
+				     active_node);
+	if (q) {
+		req = list_first_entry(&q->req_list, struct ra_req, node);
+		/* A new turn begins. */
+		if (q->deficit == 0)
+			q->deficit = max(READ_ONCE(priv->slice), 1U);
+		*len = min(ra_req_len(req) - req->progress, q->deficit);
+		*qp = q;
+	}
+	spin_unlock(&priv->req_lock);
+
+	return req;
+}
+
+/**
+ * @brief Account for a slice processed by the engine.
+ *
+ * @param priv: pointer to driver's private data
+ * @param q: queue the request belongs to
+ * @param req: request the slice belongs to
+ * @param len: number of values of the slice
+ *
+ * @return: true if the request is complete (and out of its queue).
+ */
+static bool ra_engine_advance(struct priv *priv, struct ra_queue *q,
+			      struct ra_req *req, size_t len)
+{
+	bool finished = false;
+
+	spin_lock(&priv->req_lock);
+	req->progress += len;
+	q->deficit -= len;
+	if (req->progress == ra_req_len(req)) {
+		list_del(&req->node);
+		finished = true;
+	}
+
+	if (list_empty(&q->req_list)) {
+		/* Out of the line, an idle queue keeps no budget. */
+		list_del_init(&q->active_node);
+		q->deficit = 0;
+	} else if (q->deficit == 0) {
+		/* Turn over, back of the line. */
+		list_move_tail(&q->active_node, &priv->active_list);
+	}
+	spin_unlock(&priv->req_lock);
+
+	return finished;
+}
+
+/**
+ * @brief Take every request out of the active queues, unprocessed.
+ *
+ * @param priv: pointer to driver's private data
+ * @param reqs: where to put the requests
+ */
+static void ra_engine_flush(struct priv *priv, struct list_head *reqs)
+{
+	struct ra_queue *q, *tmp;
+
+	spin_lock(&priv->req_lock);
+	list_for_each_entry_safe(q, tmp, &priv->active_list, active_node) {
+		list_splice_tail_init(&q->req_list, reqs);
+		list_del_init(&q->active_node);
+		q->deficit = 0;
+	}
+	spin_unlock(&priv->req_lock);
+}
+
+/**
+ * @brief Tell the submitter of a request that the engine is done with it.
+ *
+ * The request must not be touched anymore afterwards: its submitter may free
+ * it right away.
+ *
+ * @param req: request
+ * @param status: 0 if the request has been processed, a negative error code
+ * if it was dropped
+ */
+static void ra_req_end(struct ra_req *req, int status)
+{
+	req->status = status;
+	if (req->end)
+		req->end(req);
+	else
+		complete(&req->done);
+}
+
+/**
+ * @brief Fail every request still queued in the engine with -ENODEV.
+ *
+ * Once done, no queue is linked to the engine anymore and its load is 0 (as
+ * long as nothing is pushed meanwhile).
+ *
+ * @param priv: pointer to driver's private data
+ */
+static void ra_engine_drop(struct priv *priv)
+{
+	struct ra_req *req, *tmp;
+	LIST_HEAD(dropped);
+
+	ra_engine_flush(priv, &dropped);
+	list_for_each_entry_safe(req, tmp, &dropped, node) {
+		list_del(&req->node);
+		atomic_sub(ra_req_len(req) - req->progress, &priv->load);
+		ra_req_end(req, -ENODEV);
+	}
+}
+
+/**
+ * @brief Main loop of the engine thread.
+ *
+ * The engine owns the hardware: it is the only one reading the counter, and it
+ * processes the requests in slices, from one context after the other (and in
+ * submission order within a context). Submitters simply sleep on their
+ * request's completion in the meantime.
+ *
+ * @param arg: pointer to driver's private data
+ *
+ * @return: 0.
+ */
+static int ra_engine(void *arg)
+{
+	struct priv *priv = arg;
+	struct ra_req *req;
+	struct ra_queue *q;
+	size_t len;
+	u64 start;
+	bool fast;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(priv->engine_queue,
+					 !list_empty(&priv->active_list) ||
+						 kthread_should_stop());
+
+		while ((req = ra_engine_next(priv, &q, &len)) != NULL) {
+			start = ktime_get_ns();
+			fast = ra_engine_slice(priv, req, len);
+
+			atomic_sub(len, &priv->load);
+			atomic64_add(len * sizeof(int), &priv->stats.bytes);
+			trace_ra_hw_batch(priv->dev, req->pos + req->progress,
+					  len, req->threshold, req->encrypt,
+					  fast, req->version,
+					  ktime_get_ns() - start);
+
+			if (ra_engine_advance(priv, q, req, len))
+				ra_req_end(req, 0);
+		}
+	}
+
+	/* Do not leave anybody waiting on a request we will never process. */
+	ra_engine_drop(priv);
+
+	return 0;
+}
+
+/**
+ * @brief Hand a list of requests over to the engine of a device.
+ *
+ * The requests are queued in one go (and the engine woken up once), they will
+ * be processed in the order of the list. If the device is being removed, they
+ * are failed with -ENODEV right away. The list is left empty.
+ *
+ * @param q: queue the requests are added to
+ * @param reqs: requests to process (completions already initialized)
+ */
+static void ra_queue_push(struct ra_queue *q, struct list_head *reqs)
+{
+	struct priv *priv = q->priv;
+	struct ra_req *req, *tmp;
+	size_t len = 0;
+
+	list_for_each_entry(req, reqs, node) {
+		req->progress = 0;
+		len += ra_req_len(req);
+	}
+
+	spin_lock(&priv->req_lock);
+	if (priv->dead) {
+		spin_unlock(&priv->req_lock);
+		/* The engine is stopping (or gone), nobody would serve them. */
+		list_for_each_entry_safe(req, tmp, reqs, node) {
+			list_del(&req->node);
+			ra_req_end(req, -ENODEV);
+		}
+		return;
+	}
+	atomic_add(len, &priv->load);
+	list_splice_tail_init(reqs, &q->req_list);
+	if (list_empty(&q->active_node))
+		list_add_tail(&q->active_node, &priv->active_list);
+	spin_unlock(&priv->req_lock);
+	wake_up_interruptible(&priv->engine_queue);
+}
+
+/**
+ * @brief Spread a list of requests over the devices of the pool.
+ *
+ * Each request goes to the device with the least values waiting in its engine.
+ * The device chosen is moved to the back of the list, so that devices with the
+ * same load are used in turn. The pool's lock is held until the requests are
+ * queued: a device leaving the pool either gets them before it stops its
+ * engine (which then fails them), or is not seen at all.
+ *
+ * @param lanes: one queue per device for the submitter of the requests
+ * @param reqs: requests to process (completions already initialized)
+ */
+static void ra_pool_dispatch(struct ra_queue *lanes, struct list_head *reqs)
+{
+	struct ra_req *req, *tmp;
+	struct priv *priv, *best;
+	struct ra_queue *lane;
+	LIST_HEAD(one);
+
+	mutex_lock(&ra_pool.lock);
+	list_for_each_entry_safe(req, tmp, reqs, node) {
+		best = NULL;
+		list_for_each_entry(priv, &ra_pool.devices, pool_node) {
+			if (!best ||
+			    atomic_read(&priv->load) < atomic_read(&best->load))
+				best = priv;
+		}
+
+		if (!best) {
+			list_del(&req->node);
+			ra_req_end(req, -ENODEV);
+			continue;
+		}
+		list_move_tail(&best->pool_node, &ra_pool.devices);
+
+		/*
+		 * A lane whose device left was drained before its minor was
+		 * freed (see reds_adder_remove()), it can be reused.
+		 */
+		lane = &lanes[best->minor];
+		lane->priv = best;
+		list_move_tail(&req->node, &one);
+		ra_queue_push(lane, &one);
+	}
+	mutex_unlock(&ra_pool.lock);
+}
+
+/**
+ * @brief Hand a list of requests over to the engine(s).
+ *
+ * The requests of a device's context are processed in the order of the list.
+ * Those of a pool's context are spread over the devices, they are processed in
+ * parallel. The list is left empty.
+ *
+ * @param ctx: context the requests belong to
+ * @param reqs: requests to process (configuration and segments already set)
+ */
+static void ra_queue_list(struct ra_ctx *ctx, struct list_head *reqs)
+{
+	struct ra_req *req;
+
+	/* A context's submitters sleep until their requests are processed. */
+	list_for_each_entry(req, reqs, node) {
+		init_completion(&req->done);
+		req->end = NULL;
+	}
+
+	if (ctx->lanes)
+		ra_pool_dispatch(ctx->lanes, reqs);
+	else
+		ra_queue_push(&ctx->queue, reqs);
+}
+
+/**
+ * @brief Wait until the engine is done with a request.
+ *
+ * The wait is not interruptible: the engine works directly on the request's
+ * memory, so the request must outlive its processing. This is bounded by the
+ * time needed by the hardware to process the requests queued before ours.
+ *
+ * @param req: request previously queued
+ *
+ * @return: 0 on success, a negative error code if the request was dropped.
+ */
+static int ra_wait(struct ra_req *req)
+{
+	wait_for_completion(&req->done);
+	return req->status;
+}
+
+/**
+ * @brief Hand a request over to the engine and wait until it is processed.
+ *
+ * @param ctx: context the request belongs to
+ * @param req: request to process (configuration and segments already set)
+ *
+ * @return: 0 on success, a negative error code if the request was dropped.
+ */
+static int ra_submit(struct ra_ctx *ctx, struct ra_req *req)
+{
+	LIST_HEAD(reqs);
+
+	list_add_tail(&req->node, &reqs);
+	ra_queue_list(ctx, &reqs);
+
+	return ra_wait(req);
+}
+
+/**
+ * @brief Hand a request over to the engine(s) and wait until it is processed.
+ *
+ * On a pool's context, a long vector is split in pieces that are processed by
+ * several devices at the same time. Each piece keeps its position in the
+ * counter's sequence, so the result is the same as if a single device had
+ * processed the whole vector.
+ *
+ * @param ctx: context the request belongs to
+ * @param req: request to process (configuration and a single segment set)
+ *
+ * @return: 0 on success, a negative error code if (a piece of) the request was
+ * dropped.
+ */
+static int ra_submit_spread(struct ra_ctx *ctx, struct ra_req *req)
+{
+	size_t const len = req->segs[0].len;
+	unsigned int const nr = DIV_ROUND_UP(len, POOL_PIECE_LEN);
+	struct ra_req *pieces;
+	unsigned int i;
+	LIST_HEAD(reqs);
+	int rc = 0;
+
+	if (!ctx->lanes || nr <= 1)
+		return ra_submit(ctx, req);
+
+	/* No memory for the pieces? A single device will do. */
+	pieces = kcalloc(nr, sizeof(*pieces), GFP_KERNEL);
+	if (!pieces)
+		return ra_submit(ctx, req);
+
+	for (i = 0; i < nr; ++i) {
+		pieces[i].encrypt = req->encrypt;
+		pieces[i].threshold = req->threshold;
+		pieces[i].fast = req->fast;
+		pieces[i].sample = req->sample;
+		pieces[i].version = req->version;
+		pieces[i].pos = req->pos + i * POOL_PIECE_LEN;
+		pieces[i].nr_segs = 1;
+		pieces[i].segs[0].data =
+			req->segs[0].data + i * POOL_PIECE_LEN;
+		pieces[i].segs[0].len =
+			min_t(size_t, len - i * POOL_PIECE_LEN, POOL_PIECE_LEN);
+		list_add_tail(&pieces[i].node, &reqs);
+	}
+	ra_queue_list(ctx, &reqs);
+
+	/* Every piece must be waited for, even if one of them failed. */
+	for (i = 0; i < nr; ++i) {
+		if (ra_wait(&pieces[i]) && !rc)
+			rc = pieces[i].status;
+	}
+
+	kfree(pieces);
+	return rc;
+}
+
+/**
+ * @brief Take a consistent snapshot of the configuration.
+ *
+ * This never waits: if a change was made while we were copying, we simply copy
+ * again.
+ *
+ * @param priv: pointer to driver's private data
+ * @param config: where to store the snapshot
+ */
+static void ra_config_get(struct priv *priv, struct ra_config *config)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&priv->config_lock);
+		*config = priv->config;
+	} while (read_seqretry(&priv->config_lock, seq));
+}
+
+/**
+ * @brief Capture the configuration a request has to be processed with.
+ *
+ * @param ctx: context the request belongs to
+ * @param req: request being built
+ * @param op: RA_OP_ENCRYPT, RA_OP_DECRYPT, or RA_OP_DEVICE to use the operation
+ * selected through sysfs
+ */
+static void ra_capture_config(struct ra_ctx *ctx, struct ra_req *req, int op)
+{
+	struct ra_config config;
+
+	ra_config_get(ctx->priv, &config);
+	req->encrypt = op == RA_OP_DEVICE ? config.encrypt : op == RA_OP_ENCRYPT;
+	req->threshold = config.threshold;
+	req->fast = config.fast;
+	req->sample = config.fast_sample;
+	req->version = config.version;
+}
+
+/**
+ * @brief Initialization of the device file.
+ *
+ * Each open() gets its own context (KFIFO, operation, position in the counter's
+ * sequence), which starts from a known state. The counter itself is shared and
+ * thus left alone: the engine brings it to the right position for each
+ * request.
+ *
+ * @param inode: structure used by the kernel to hold file information
+ * @param filp: higher-level file description, that tracks the current cursor
+ * position, thus used when the file is actually open.
+ *
+ * @return: 0 on success, a negative error code otherwise.
+ */
+static int ra_file_open(struct inode *inode, struct file *filp)
+{
+	/*
+	 * Retrieve the pointer to the private data embedded into the 'inode'
+	 * structure using the 'container_of' macro.
+	 * More info on this macro here:
+	 * https://www.linuxjournal.com/files/linuxjournal.com/linuxjournal/articles/067/6717/6717s2.html
+	 */
+	struct priv *priv = container_of(inode->i_cdev, struct priv, cdev);
+	struct ra_ctx *ctx;
+	unsigned int i;
+	int rc;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	/* A pool's context needs a queue for each device. */
+	if (priv->pool) {
+		ctx->lanes = kcalloc(MAX_DEVICES, sizeof(*ctx->lanes),
+				     GFP_KERNEL);
+		if (!ctx->lanes) {
+			kfree(ctx);
+			return -ENOMEM;
+		}
+		for (i = 0; i < MAX_DEVICES; ++i) {
+			INIT_LIST_HEAD(&ctx->lanes[i].req_list);
+			INIT_LIST_HEAD(&ctx->lanes[i].active_node);
+		}
+	}
+
+	/* Initialize the KFIFO used to store the data. */
+	rc = kfifo_alloc(&ctx->data_fifo, priv->fifo_size, GFP_KERNEL);
+	if (rc) {
+		kfree(ctx->lanes);
+		kfree(ctx);
+		return rc;
+	}
+
+	ctx->priv = priv;
+	ctx->op = RA_OP_DEVICE;
+	mutex_init(&ctx->read_mutex);
+	mutex_init(&ctx->write_mutex);
+	init_waitqueue_head(&ctx->read_queue);
+	init_waitqueue_head(&ctx->write_queue);
+	mutex_init(&ctx->ring_mutex);
+	ctx->queue.priv = priv;
+	INIT_LIST_HEAD(&ctx->queue.req_list);
+	INIT_LIST_HEAD(&ctx->queue.active_node);
+
+	/*
+	 * Store the pointer to the context in the 'file' structure for later
+	 * use.
+	 */
+	filp->private_data = ctx;
+
+	/*
+	 * Since the device file we created does not support lseek(), we have to
+	 * do this (instead of simply returning 0.
+	 */
+	return nonseekable_open(inode, filp);
+}
+
+/**
+ * @brief Function called after a file close() is requested by the user.
+
+ * @param inode: structure used by the kernel to hold file information
+ * @param filp: higher-level file description, that tracks the current cursor
+ * position, thus used when the file is actually open.
+
+ * @return: 0.
+ */
+static int ra_file_release(struct inode *inode, struct file *filp)
+{
+	struct ra_ctx *ctx = filp->private_data;
+
+	/*
+	 * Nobody can be using the context anymore (the mappings of the ring
+	 * hold a reference to the file), and all of its requests have been
+	 * waited for.
+	 */
+	kfifo_free(&ctx->data_fifo);
+	vfree(ctx->ring);
+	kfree(ctx->lanes);
+	kfree(ctx);
+
+	/*
+	 * Invalidate the pointer stored in the 'file' structure.
+	 */
+	filp->private_data = NULL;
+
+	return 0;
+}
+
+/**
+ * @brief Account for a completed read() in the statistics.
+ *
+ * @param priv: pointer to driver's private data
+ * @param ctx: context of the read()
+ * @param count: number of bytes read
+ * @param latency_ns: duration of the read(), in ns
+ */
+static void ra_account_read(struct priv *priv, struct ra_ctx *ctx,
+			    size_t count, u64 latency_ns)
+{
+	unsigned int bucket = latency_ns ? ilog2(latency_ns) : 0;
+
+	atomic64_inc(&priv->stats.lat_hist[min(bucket, LAT_BUCKETS - 1U)]);
+	trace_ra_read_complete(priv->dev, ctx, count, latency_ns);
+}
+
+/**
+ * @brief Number of bytes of an I/O vector the device can transfer.
+ *
+ * A user's buffer MUST hold whole integers. The pipe of a splice(), however,
+ * holds whatever was put in it, and may well end in the middle of an integer
+ * (or have room for part of one only): we transfer the whole integers, and the
+ * rest stays in the pipe until more bytes arrive (or more room is made).
+ *
+ * @param iter: I/O vector
+ *
+ * @return: the size of the I/O vector, rounded down to whole integers.
+ */
+static size_t ra_iter_count(struct iov_iter *iter)
+{
+	return rounddown(iov_iter_count(iter), sizeof(int));
+}
+
+/**
+ * @brief Retrieve an "encrypted/decrypted" vector from the device.
+ *
+ * Partial reads are allowed: the context keeps track of its position in the
+ * counter's sequence, so reading a vector in several pieces gives the same
+ * result as reading it at once.
+ *
+ * A read() can be of any length, even larger than the KFIFO: the data is
+ * streamed through the KFIFO and processed one chunk (at most a full KFIFO) at a
+ * time, while the writers refill it. The read() blocks until all the data
+ * requested has been processed. If it is interrupted by a signal (or fails)
+ * after some progress, it returns the number of bytes already given back, like
+ * a read() on a pipe would.
+ *
+ * A non-blocking read() (O_NONBLOCK) never sleeps for data: it gives back what
+ * is in the KFIFO right now, and fails with -EAGAIN if there is nothing.
+ *
+ * The reader keeps the read mutex for the whole read(), so that the data it
+ * gets is contiguous in the stream.
+ *
+ * A readv() is handled as a single read() of the total size, scattered over the
+ * user's buffers. splice() (and sendfile()) from the device file go through
+ * here too, the data being copied straight into the pages of the pipe.
+ *
+ * @param iocb: I/O control block (gives access to the file descriptor in use)
+ * @param to: user space buffer(s) the data has to be copied to
+ *
+ * @return: Number of bytes read from the internal KFIFO, or a negative error
+ * code if an error occurred before any progress.
+ */
+static ssize_t ra_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	/*
+	 * Retrieve the pointer to our context, and to our private data.
+	 */
+	struct ra_ctx *ctx = iocb->ki_filp->private_data;
+	struct priv *priv = ctx->priv;
+
+	/* Size of the transfer requested (whole integers only). */
+	size_t const count = ra_iter_count(to);
+	/* Largest chunk processed at once: what the KFIFO can hold. */
+	size_t const max_chunk =
+		min_t(size_t, count, kfifo_size(&ctx->data_fifo));
+	/* Size of the current chunk. */
+	size_t chunk;
+	/* Bytes already given back to the user. */
+	size_t done = 0;
+	size_t copied;
+
+	/* Request handed over to the engine, reused for each chunk. */
+	struct ra_req *req;
+
+	/* O_NONBLOCK on the file, or RWF_NOWAIT for this very call. */
+	bool const nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+			      (iocb->ki_flags & IOCB_NOWAIT);
+
+	/* Start of the read(), and of the wait for the mutex. */
+	u64 const start = ktime_get_ns();
+	u64 wait_start;
+
+	int rc = 0;
+
+	/*
+	 * Since we operate on integers, we expect that the user asks for a number
+	 * of bytes that is a multiple of the size of an integer.
+	 */
+	if (iov_iter_count(to) % sizeof(int) != 0 && user_backed_iter(to)) {
+		dev_err(priv->dev,
+			"read(): the device operates on integers !\n");
+		return 0;
+	}
+	if (count == 0)
+		return 0;
+
+	/*
+	 * Each reader gets its own request (and its own copy of the data), so
+	 * that several contexts can be queued in the engine at the same time.
+	 * A large KFIFO gives large chunks, hence kvmalloc().
+	 */
+	req = kvmalloc(struct_size(req, buf, max_chunk / sizeof(int)),
+		       GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	trace_ra_read_start(priv->dev, ctx, count);
+
+	/*
+	 * First thing, acquire the lock that serializes the readers. A reader
+	 * holding it may be sleeping until enough data arrives, so a
+	 * non-blocking reader does not wait for it.
+	 */
+	if (nonblock) {
+		if (!mutex_trylock(&ctx->read_mutex)) {
+			kvfree(req);
+			return -EAGAIN;
+		}
+	} else {
+		wait_start = ktime_get_ns();
+		mutex_lock(&ctx->read_mutex);
+		atomic64_add(ktime_get_ns() - wait_start,
+			     &priv->stats.mutex_wait_ns);
+	}
+
+	while (done < count) {
+		/*
+		 * Wait for a whole chunk: the rest of the read(), or a full
+		 * KFIFO if the rest does not fit in it. A non-blocking read()
+		 * takes whatever is there.
+		 */
+		chunk = min(count - done, max_chunk);
+		if (kfifo_len(&ctx->data_fifo) < chunk) {
+			if (nonblock) {
+				chunk = rounddown(kfifo_len(&ctx->data_fifo),
+						  sizeof(int));
+				if (chunk == 0) {
+					rc = -EAGAIN;
+					break;
+				}
+			} else {
+				rc = wait_event_interruptible(
+					ctx->read_queue,
+					kfifo_len(&ctx->data_fifo) >= chunk);
+				if (rc)
+					break;
+				dev_dbg(priv->dev,
+					"read(): received wake up!\n");
+			}
+		}
+
+		/*
+		 * Instead of operating on a value at a time, we dump the chunk
+		 * in the request's buffer, and then encrypt/decrypt on the go.
+		 */
+		if (kfifo_out(&ctx->data_fifo, req->buf, chunk) < chunk) {
+			dev_err(priv->dev,
+				"read(): missing data in kfifo_out() !\n");
+			rc = -EFAULT;
+			break;
+		}
+
+		/* Some room was made, tell the writers (or poll()ers). */
+		wake_up_interruptible(&ctx->write_queue);
+
+		/* Capture the configuration this chunk has to be processed with. */
+		ra_capture_config(ctx, req, READ_ONCE(ctx->op));
+		req->pos = ctx->seq_pos;
+		req->nr_segs = 1;
+		req->segs[0].data = req->buf;
+		req->segs[0].len = chunk / sizeof(int);
+		ctx->seq_pos += chunk / sizeof(int);
+
+		/* Perform the hardware-assisted encryption/decryption. */
+		rc = ra_submit_spread(ctx, req);
+		if (rc)
+			break;
+
+		/* Copy the data to the user. */
+		copied = copy_to_iter(req->buf, chunk, to);
+		done += copied;
+		if (copied != chunk) {
+			dev_err(priv->dev,
+				"read(): error occurred in copy_to_user() operation !\n");
+			rc = -EFAULT;
+			break;
+		}
+	}
+
+	mutex_unlock(&ctx->read_mutex);
+	kvfree(req);
+
+	/* Report the progress made, the error (if any) will come next time. */
+	if (done) {
+		ra_account_read(priv, ctx, done, ktime_get_ns() - start);
+		return done;
+	}
+
+	trace_ra_read_complete(priv->dev, ctx, rc, ktime_get_ns() - start);
+	return rc;
+}
+
+/**
+ * @brief Store a vector to encode in the internal KFIFO.
+ *
+ * When the KFIFO is full, the writer sleeps until a reader makes room (or fails
+ * with -EAGAIN if the file was opened with O_NONBLOCK). A vector larger than the
+ * free space is stored piece by piece as room is made; writers are serialized,
+ * so the vectors of two writers never get mixed. If the write() is interrupted
+ * by a signal (or made non-blocking) after some progress, it returns the number
+ * of bytes already stored, like a write() on a pipe would.
+ *
+ * A writev() is handled as a single write() of the total size, gathered from
+ * the user's buffers. splice() (and sendfile()) to the device file go through
+ * here too (see iter_file_splice_write()), the data being copied straight from
+ * the pages of the pipe.
+ *
+ * @param iocb: I/O control block (gives access to the file descriptor in use)
+ * @param from: user space buffer(s) the data comes from
+ *
+ * @return: Number of bytes written in the internal KFIFO, or a negative error
+ * code if an error occurred before any progress.
+ */
+static ssize_t ra_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	/*
+	 * Retrieve the pointer to our context, and to our private data.
+	 */
+	struct ra_ctx *ctx = iocb->ki_filp->private_data;
+	struct priv *priv = ctx->priv;
+
+	/* Size of the transfer requested (whole integers only). */
+	size_t const count = ra_iter_count(from);
+	/* Bytes already stored in the KFIFO, and size of the current piece. */
+	size_t done = 0;
+	size_t chunk;
+
+	/* Free space of the KFIFO (it might wrap around the end of its buffer). */
+	struct scatterlist sgl[2];
+	struct scatterlist *sg;
+	unsigned int nents;
+	unsigned int i;
+
+	/* O_NONBLOCK on the file, or RWF_NOWAIT for this very call. */
+	bool const nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+			      (iocb->ki_flags & IOCB_NOWAIT);
+
+	/* Start of the wait for the mutex. */
+	u64 wait_start;
+
+	int rc = 0;
+
+	/*
+	 * Since we operate on integers, we expect that the user offers a number
+	 * of bytes that is a multiple of the size of an integer.
+	 */
+	if (iov_iter_count(from) % sizeof(int) != 0 && user_backed_iter(from)) {
+		dev_err(priv->dev,
+			"write(): the device operates on integers !\n");
+		return -EINVAL;
+	}
+	if (count == 0)
+		return 0;
+
+	/* Acquire the lock that serializes the writers. */
+	if (nonblock) {
+		if (!mutex_trylock(&ctx->write_mutex))
+			return -EAGAIN;
+	} else {
+		wait_start = ktime_get_ns();
+		mutex_lock(&ctx->write_mutex);
+		atomic64_add(ktime_get_ns() - wait_start,
+			     &priv->stats.mutex_wait_ns);
+	}
+
+	while (done < count) {
+		/*
+		 * Wait for room in the KFIFO: the readers wake us up each time
+		 * they take some data out of it.
+		 */
+		if (kfifo_avail(&ctx->data_fifo) < sizeof(int)) {
+			if (nonblock) {
+				rc = -EAGAIN;
+				break;
+			}
+			rc = wait_event_interruptible(
+				ctx->write_queue,
+				kfifo_avail(&ctx->data_fifo) >= sizeof(int));
+			if (rc)
+				break;
+		}
+		chunk = min_t(size_t, count - done,
+			      rounddown(kfifo_avail(&ctx->data_fifo),
+					sizeof(int)));
+
+		/*
+		 * Copy the data from the user straight into the free space of
+		 * the KFIFO: the DMA helpers give us that space as (at most two)
+		 * memory chunks, and the data is only published once all of it
+		 * has been copied.
+		 */
+		sg_init_table(sgl, ARRAY_SIZE(sgl));
+		nents = kfifo_dma_in_prepare(&ctx->data_fifo, sgl,
+					     ARRAY_SIZE(sgl), chunk);
+		for_each_sg(sgl, sg, nents, i) {
+			if (copy_from_iter(sg_virt(sg), sg->length, from) !=
+			    sg->length) {
+				dev_err(priv->dev,
+					"write(): error occurred in copy_from_iter() operation !\n");
+				rc = -EFAULT;
+				break;
+			}
+		}
+		if (rc)
+			break;
+		kfifo_dma_in_finish(&ctx->data_fifo, chunk);
+		done += chunk;
+		trace_ra_write_enqueue(priv->dev, ctx, chunk,
+				       kfifo_len(&ctx->data_fifo));
+
+		/* Wake the read() up (if it was sleeping). */
+		wake_up_interruptible(&ctx->read_queue);
+	}
+
+	mutex_unlock(&ctx->write_mutex);
+
+	/* Report the progress made, the error (if any) will come next time. */
+	return done ? done : rc;
+}
+
+/**
+ * @brief Tell poll()/select()/epoll what can be done on the device file.
+ *
+ * The file is readable as soon as at least one integer is queued in the KFIFO
+ * (a read() of that size would not block), and writable as long as there is
+ * room for at least one integer. The writers wake the readers up and the
+ * readers wake the writers up, so both wait queues are registered.
+ *
+ * @param filp: pointer to the file descriptor in use
+ * @param wait: poll table given by the kernel
+ *
+ * @return: mask of the events that are ready.
+ */
+static __poll_t ra_file_poll(struct file *filp, poll_table *wait)
+{
+	struct ra_ctx *ctx = filp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &ctx->read_queue, wait);
+	poll_wait(filp, &ctx->write_queue, wait);
+
+	if (kfifo_len(&ctx->data_fifo) >= sizeof(int))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (kfifo_avail(&ctx->data_fifo) >= sizeof(int))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+/**
+ * @brief Map the ring shared with user space.
+ *
+ * The whole ring (header and slots) can be mapped, always starting at offset 0.
+ * The ring is only allocated on the first mmap(), contexts that never use it do
+ * not pay for it. Since the memory was obtained with vmalloc_user(), the kernel
+ * does all the page-table work for us in remap_vmalloc_range().
+ *
+ * @param filp: pointer to the file descriptor in use
+ * @param vma: user space memory area to be mapped
+ *
+ * @return: 0 on success, a negative error code otherwise.
+ */
+static int ra_file_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct ra_ctx *ctx = filp->private_data;
+	int rc = 0;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > RING_SIZE) {
+		dev_err(ctx->priv->dev, "mmap(): invalid offset or size !\n");
+		return -EINVAL;
+	}
+
+	mutex_lock(&ctx->ring_mutex);
+	if (!ctx->ring) {
+		ctx->ring = vmalloc_user(RING_SIZE);
+		if (!ctx->ring) {
+			rc = -ENOMEM;
+			goto unlock;
+		}
+		ctx->ring->entries = RING_ENTRIES;
+		ctx->ring->data_offset = PAGE_SIZE;
+		ctx->ring->map_size = RING_SIZE;
+	}
+	rc = remap_vmalloc_range(vma, ctx->ring, 0);
+
+unlock:
+	mutex_unlock(&ctx->ring_mutex);
+	return rc;
+}
+
+/**
+ * @brief Process all the slots user space has produced in the shared ring.
+ *
+ * The slots between 'done' and 'prod' are encrypted or decrypted in place, as
+ * a single vector. The ring is a stream: the position of a slot in the
+ * counter's sequence is the number of slots processed before it (its
+ * free-running index, not truncated to 32 bits), so the results do not depend
+ * on how often the doorbell is rung.
+ *
+ * @param ctx: context owning the ring
+ *
+ * @return: number of slots processed, or a negative error code.
+ */
+static long ra_ring_kick(struct ra_ctx *ctx)
+{
+	u32 const mask = RING_ENTRIES - 1;
+	struct ra_req req;
+	int *data;
+	u32 prod;
+	u32 head;
+	u32 len;
+	int rc;
+
+	mutex_lock(&ctx->ring_mutex);
+
+	/* Nothing to process if the ring was never mapped. */
+	if (!ctx->ring) {
+		mutex_unlock(&ctx->ring_mutex);
+		return -ENXIO;
+	}
+	data = (int *)((char *)ctx->ring + PAGE_SIZE);
+
+	/*
+	 * Pairs with the release store user space does on 'prod' once its slots
+	 * are filled: the values are visible once we see the new index.
+	 */
+	prod = smp_load_acquire(&ctx->ring->prod);
+	len = prod - ctx->ring_done;
+	if (len > RING_ENTRIES) {
+		mutex_unlock(&ctx->ring_mutex);
+		dev_err(ctx->priv->dev, "ring: producer index out of range !\n");
+		return -EINVAL;
+	}
+
+	if (len != 0) {
+		ra_capture_config(ctx, &req, READ_ONCE(ctx->op));
+		req.pos = ctx->ring_pos;
+
+		/* The vector might wrap around the end of the ring. */
+		head = ctx->ring_done & mask;
+		req.segs[0].data = data + head;
+		req.segs[0].len = min(len, RING_ENTRIES - head);
+		req.segs[1].data = data;
+		req.segs[1].len = len - req.segs[0].len;
+		req.nr_segs = 2;
+
+		rc = ra_submit(ctx, &req);
+		if (rc) {
+			mutex_unlock(&ctx->ring_mutex);
+			return rc;
+		}
+
+		ctx->ring_done += len;
+		ctx->ring_pos += len;
+		/* Publish the results before the new index. */
+		smp_store_release(&ctx->ring->done, ctx->ring_done);
+	}
+
+	mutex_unlock(&ctx->ring_mutex);
+	return len;
+}
+
+/**
+ * @brief Process a batch of vectors described by user space.
+ *
+ * All the vectors are copied in first, and queued to the engine in one go so
+ * that the hardware processes them back-to-back; the results are then copied
+ * out. The whole batch costs a single system call.
+ *
+ * @param ctx: context the batch is submitted from
+ * @param ubatch: user space address of the batch description
+ *
+ * @return: number of descriptors processed, or a negative error code.
+ */
+static long ra_do_batch(struct ra_ctx *ctx, struct ra_batch __user *ubatch)
+{
+	struct ra_batch batch;
+	struct ra_desc *descs;
+	struct ra_req **reqs;
+	LIST_HEAD(queue);
+	size_t total = 0;
+	long rc = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)) != 0)
+		return -EFAULT;
+
+	if (batch.pad != 0 || batch.count == 0 ||
+	    batch.count > RA_BATCH_MAX_DESCS)
+		return -EINVAL;
+
+	descs = memdup_user(u64_to_user_ptr(batch.descs),
+			    array_size(batch.count, sizeof(*descs)));
+	if (IS_ERR(descs))
+		return PTR_ERR(descs);
+
+	/* Validate the whole batch before doing anything. */
+	for (i = 0; i < batch.count; ++i) {
+		if (descs[i].op != RA_OP_ENCRYPT &&
+		    descs[i].op != RA_OP_DECRYPT) {
+			rc = -EINVAL;
+			goto free_descs;
+		}
+		total += descs[i].len;
+		if (total > RA_BATCH_MAX_VALUES) {
+			rc = -E2BIG;
+			goto free_descs;
+		}
+	}
+
+	reqs = kcalloc(batch.count, sizeof(*reqs), GFP_KERNEL);
+	if (!reqs) {
+		rc = -ENOMEM;
+		goto free_descs;
+	}
+
+	for (i = 0; i < batch.count; ++i) {
+		struct ra_req *req;
+
+		req = kmalloc(struct_size(req, buf, descs[i].len), GFP_KERNEL);
+		if (!req) {
+			rc = -ENOMEM;
+			goto free_reqs;
+		}
+		reqs[i] = req;
+
+		if (copy_from_user(req->buf, u64_to_user_ptr(descs[i].in),
+				   descs[i].len * sizeof(int)) != 0) {
+			rc = -EFAULT;
+			goto free_reqs;
+		}
+
+		ra_capture_config(ctx, req, descs[i].op);
+		req->pos = 0;
+		req->nr_segs = 1;
+		req->segs[0].data = req->buf;
+		req->segs[0].len = descs[i].len;
+		list_add_tail(&req->node, &queue);
+	}
+
+	ra_queue_list(ctx, &queue);
+
+	/*
+	 * Wait for every request, even if one of them fails: the engine still
+	 * owns the ones we would not wait for.
+	 */
+	for (i = 0; i < batch.count; ++i) {
+		int status = ra_wait(reqs[i]);
+
+		if (status) {
+			rc = status;
+			continue;
+		}
+		if (!rc && copy_to_user(u64_to_user_ptr(descs[i].out),
+					reqs[i]->buf,
+					descs[i].len * sizeof(int)) != 0)
+			rc = -EFAULT;
+	}
+	if (!rc)
+		rc = batch.count;
+
+free_reqs:
+	for (i = 0; i < batch.count; ++i)
+		kfree(reqs[i]);
+	kfree(reqs);
+free_descs:
+	kfree(descs);
+	return rc;
+}
+
+/**
+ * @brief Device file ioctl callback.
+ *
+ * @param filp: pointer to the file descriptor in use
+ * @param cmd: ioctl command (see reds_adder_v3.h)
+ * @param arg: command's argument
+ *
+ * @return: command-specific value, or a negative error code.
+ */
+static long ra_file_ioctl(struct file *filp, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct ra_ctx *ctx = filp->private_data;
+
+	switch (cmd) {
+	case RA_IOC_RING_KICK:
+		return ra_ring_kick(ctx);
+	case RA_IOC_BATCH:
+		return ra_do_batch(ctx, (struct ra_batch __user *)arg);
+	case RA_IOC_SET_OP:
+		if (arg != RA_OP_ENCRYPT && arg != RA_OP_DECRYPT &&
+		    arg != RA_OP_DEVICE)
+			return -EINVAL;
+		WRITE_ONCE(ctx->op, arg);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/**
+ * @brief Display the maximum length (in bytes) of a message that can be queued
+ * without blocking the writer (read()s and write()s can be longer).
+ *
+ * This function is pretty useless, since the returned value is a constant.
+ * However, it shows you that it is not mandatory to implement both the show() and
+ * the store() operations -- please check the permissions on the corresponding
+ * file in sysfs !
+ *
+ * @param dev: pointer to our device
+ * @param attr: pointer to the associated attributes (ignored)
+ * @param buf: output buffer (where data for the user will be put)
+ *
+ * @returns: number of bytes produced
+ */
+static ssize_t show_max_str_len(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct priv *priv = dev_get_drvdata(dev);
+
+	/*
+	 * Where does this 'PAGE_SIZE' constant come from? It's a symbol exported
+	 * by the kernel. It's important in this case, since sysfs' I/Os are
+	 * limited to a page.
+	 */
+	return snprintf(buf, PAGE_SIZE, "%u\n", priv->fifo_size);
+}
+
+/**
+ * @brief Change the operation performed by the device
+ * ("encryption" <-> "decryption).
+ *
+ * The change gives a new version of the configuration, used by the requests
+ * built from now on: requests already submitted (or being processed) are not
+ * affected, and they never prevent the change either.
+ *
+ * @param dev: pointer to our device
+ * @param attr: pointer to the associated attributes (ignored)
+ * @param buf: input buffer (where user input will show up)
+ * @param count: number of bytes to read from the input buffer
+ *
+ * @returns: number of bytes processed
  */
 static ssize_t store_operation(struct device *dev,
 			       struct device_attribute *attr, const char *buf,
 			       size_t count)
 {
 	struct priv *priv = dev_get_drvdata(dev);
+	bool encrypt;
 
-	if (mutex_trylock(&priv->read_mutex)) {
-		/*
-		 * !! WARNING !!
-		 * If we pass an operation with 'echo', for instance
-		 * echo "encrypt" > operation
-		 * sysfs will take a '\n' character at the end, which will
-		 * invalidate the strcmp() results. To avoid this issue, we force
-		 * the number of characters in the comparison (in this way, any
-		 * additional character will be ignored). This has the side effect
-		 * that 'encryptABCD' will also turn on the encryption, but we
-		 * can live with that...
-		 */
-		if (strncmp(buf, "encrypt", strlen("encrypt")) == 0) {
-			priv->encrypt = true;
-		} else {
-			if (strncmp(buf, "decrypt", strlen("decrypt")) == 0) {
-				priv->encrypt = false;
-			} else {
-				dev_err(priv->dev,
-					"Invalid operation requested!\n");
-				return -EINVAL;
-			}
-		}
-		mutex_unlock(&priv->read_mutex);
+	/*
+	 * !! WARNING !!
+	 * If we pass an operation with 'echo', for instance
+	 * echo "encrypt" > operation
+	 * sysfs will take a '\n' character at the end, which will invalidate the
+	 * strcmp() results. To avoid this issue, we force the number of
+	 * characters in the comparison (in this way, any additional character
+	 * will be ignored). This has the side effect that 'encryptABCD' will also
+	 * turn on the encryption, but we can live with that...
+	 */
+	if (strncmp(buf, "encrypt", strlen("encrypt")) == 0) {
+		encrypt = true;
+	} else if (strncmp(buf, "decrypt", strlen("decrypt")) == 0) {
+		encrypt = false;
 	} else {
-		dev_err(priv->dev,
-			"read() undergoing, cannot change operation now!\n");
+		dev_err(priv->dev, "Invalid operation requested!\n");
 		return -EINVAL;
 	}
 
+	write_seqlock(&priv->config_lock);
+	priv->config.encrypt = encrypt;
+	priv->config.version++;
+	write_sequnlock(&priv->config_lock);
+
 	return count;
 }
 
@@ -629,19 +2301,15 @@ static ssize_t show_operation(struct device *dev, struct device_attribute *attr,
 	 * huge and error prone.
 	 */
 	return snprintf(buf, PAGE_SIZE, "%s\n",
-			priv->encrypt ? "encrypt" : "decrypt");
+			READ_ONCE(priv->config.encrypt) ? "encrypt" : "decrypt");
 }
 
 /**
  * @brief Set a new threshold for the encryption/decryption process.
  *
- * Since this operation heavily impacts the encryption/decryption process, we
- * prevent the user from using it when a read() operation is in progress.
- * This is achieved thanks to a mutex that is acquired by the read() operation
- * when it starts, and not released until the operation is completed (warning: the
- * read might be put to sleep if the KFIFO does not contain enough samples -- to
- * avoid having a read on this sysfs entry stuck too, we use a trylock on the
- * mutex).
+ * The change gives a new version of the configuration, used by the requests
+ * built from now on: requests already submitted (or being processed) are not
+ * affected, and they never prevent the change either.
  *
  * @param dev: pointer to our device
  * @param attr: pointer to the associated attributes (ignored)
@@ -655,33 +2323,27 @@ static ssize_t store_threshold(struct device *dev,
 			       size_t count)
 {
 	struct priv *priv = dev_get_drvdata(dev);
+	int tmp;
+	int rc;
 
-	if (mutex_trylock(&priv->read_mutex)) {
-		int tmp;
-		int rc;
-
-		/*
-		 * Do NOT forget to release the lock if things go bad...
-		 */
-		rc = kstrtoint(buf, 10, &tmp);
-		if (rc != 0) {
-			mutex_unlock(&priv->read_mutex);
-			return rc;
-		}
-		if (tmp <= 0) {
-			dev_err(priv->dev, "Invalid threshold specified!\n");
-			mutex_unlock(&priv->read_mutex);
-			return -EINVAL;
-		}
+	rc = kstrtoint(buf, 10, &tmp);
+	if (rc != 0)
+		return rc;
+	if (tmp <= 0) {
+		dev_err(priv->dev, "Invalid threshold specified!\n");
+		return -EINVAL;
+	}
 
-		priv->threshold = tmp;
-		ra_write(priv, THRESH_REG_OFF, priv->threshold);
+	/*
+	 * The new threshold is programmed in the device by the engine, before
+	 * it processes the first request submitted with it.
+	 */
+	write_seqlock(&priv->config_lock);
+	priv->config.threshold = tmp;
+	priv->config.version++;
+	write_sequnlock(&priv->config_lock);
 
-		mutex_unlock(&priv->read_mutex);
-		return count;
-	}
-	dev_err(priv->dev, "read() undergoing, cannot change threshold now!\n");
-	return -EINVAL;
+	return count;
 }
 
 /**
@@ -701,7 +2363,275 @@ static ssize_t show_threshold(struct device *dev, struct device_attribute *attr,
 	/*
 	 * Use sysfs_emit as it will be aware of PAGE_SIZE
 	 */
-	return sysfs_emit(buf, "%d\n", priv->threshold);
+	return sysfs_emit(buf, "%d\n", READ_ONCE(priv->config.threshold));
+}
+
+/**
+ * @brief Choose how the counter's values are obtained.
+ *
+ * "hardware" reads every value from the device, "fast" computes them (see
+ * ra_fast_run()). Selecting "fast" again also resumes a fast mode that was
+ * suspended because the device disagreed with us (for the pool, on any of its
+ * devices). As for the operation, the change applies to the requests built
+ * from now on.
+ *
+ * @param dev: pointer to our device
+ * @param attr: pointer to the associated attributes (ignored)
+ * @param buf: input buffer (where user input will show up)
+ * @param count: number of bytes to read from the input buffer
+ *
+ * @returns: number of bytes processed
+ */
+static ssize_t store_mode(struct device *dev, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct priv *priv = dev_get_drvdata(dev);
+	struct priv *p;
+	bool fast;
+
+	if (sysfs_streq(buf, "fast")) {
+		fast = true;
+	} else if (sysfs_streq(buf, "hardware")) {
+		fast = false;
+	} else {
+		dev_err(priv->dev, "Invalid mode requested!\n");
+		return -EINVAL;
+	}
+
+	write_seqlock(&priv->config_lock);
+	priv->config.fast = fast;
+	priv->config.version++;
+	write_sequnlock(&priv->config_lock);
+	if (!fast)
+		return count;
+
+	WRITE_ONCE(priv->fast_diverged, false);
+	/* The engines check their own device's flag, not the pool's one. */
+	if (priv->pool) {
+		mutex_lock(&ra_pool.lock);
+		list_for_each_entry(p, &ra_pool.devices, pool_node)
+			WRITE_ONCE(p->fast_diverged, false);
+		mutex_unlock(&ra_pool.lock);
+	}
+
+	return count;
+}
+
+/**
+ * @brief Display how the counter's values are obtained.
+ *
+ * The pool's fast mode is shown as diverged as soon as one of its devices is.
+ *
+ * @param dev: pointer to our device
+ * @param attr: pointer to the associated attributes (ignored)
+ * @param buf: output buffer (where data for the user will be put)
+ *
+ * @returns: number of bytes produced
+ */
+static ssize_t show_mode(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct priv *priv = dev_get_drvdata(dev);
+	bool diverged = READ_ONCE(priv->fast_diverged);
+	struct priv *p;
+
+	if (!READ_ONCE(priv->config.fast))
+		return sysfs_emit(buf, "hardware\n");
+	if (priv->pool) {
+		mutex_lock(&ra_pool.lock);
+		list_for_each_entry(p, &ra_pool.devices, pool_node)
+			diverged |= READ_ONCE(p->fast_diverged);
+		mutex_unlock(&ra_pool.lock);
+	}
+	if (diverged)
+		return sysfs_emit(buf, "fast (diverged, using hardware)\n");
+	return sysfs_emit(buf, "fast\n");
+}
+
+/**
+ * @brief Set how often a computed value is checked in fast mode.
+ *
+ * One value out of N is read from the device, 0 disables the checks.
+ *
+ * @param dev: pointer to our device
+ * @param attr: pointer to the associated attributes (ignored)
+ * @param buf: input buffer (where user input will show up)
+ * @param count: number of bytes to read from the input buffer
+ *
+ * @returns: number of bytes processed
+ */
+static ssize_t store_fast_sample(struct device *dev,
+				 struct device_attribute *attr, const char *buf,
+				 size_t count)
+{
+	struct priv *priv = dev_get_drvdata(dev);
+	u32 tmp;
+	int rc;
+
+	rc = kstrtou32(buf, 10, &tmp);
+	if (rc != 0)
+		return rc;
+
+	write_seqlock(&priv->config_lock);
+	priv->config.fast_sample = tmp;
+	priv->config.version++;
+	write_sequnlock(&priv->config_lock);
+
+	return count;
+}
+
+/**
+ * @brief Display how often a computed value is checked in fast mode.
+ *
+ * @param dev: pointer to our device
+ * @param attr: pointer to the associated attributes (ignored)
+ * @param buf: output buffer (where data for the user will be put)
+ *
+ * @returns: number of bytes produced
+ */
+static ssize_t show_fast_sample(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct priv *priv = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->config.fast_sample));
+}
+
+/**
+ * @brief Set the number of values of a context processed in a row.
+ *
+ * Small slices bound the latency of the contexts with small requests, large
+ * ones let a context with large requests keep the counter where it is (and
+ * avoid seeking it back and forth). The new budget applies from the next turn
+ * of a context on. Setting it for the pool sets it for all its devices.
+ *
+ * @param dev: pointer to our device
+ * @param attr: pointer to the associated attributes (ignored)
+ * @param buf: input buffer (where user input will show up)
+ * @param count: number of bytes to read from the input buffer
+ *
+ * @returns: number of bytes processed
+ */
+static ssize_t store_slice(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct priv *priv = dev_get_drvdata(dev);
+	struct priv *p;
+	u32 tmp;
+	int rc;
+
+	rc = kstrtou32(buf, 10, &tmp);
+	if (rc != 0)
+		return rc;
+	if (tmp == 0) {
+		dev_err(priv->dev, "Invalid slice specified!\n");
+		return -EINVAL;
+	}
+
+	/* Only read by the engine, when a turn begins. */
+	WRITE_ONCE(priv->slice, tmp);
+
+	if (priv->pool) {
+		mutex_lock(&ra_pool.lock);
+		list_for_each_entry(p, &ra_pool.devices, pool_node)
+			WRITE_ONCE(p->slice, tmp);
+		mutex_unlock(&ra_pool.lock);
+	}
+
+	return count;
+}
+
+/**
+ * @brief Display the number of values of a context processed in a row.
+ *
+ * @param dev: pointer to our device
+ * @param attr: pointer to the associated attributes (ignored)
+ * @param buf: output buffer (where data for the user will be put)
+ *
+ * @returns: number of bytes produced
+ */
+static ssize_t show_slice(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct priv *priv = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->slice));
+}
+
+/*
+ * debugfs files for the counters of 'struct ra_stats': reading gives the value,
+ * writing anything resets it.
+ */
+static int ra_debugfs_counter_get(void *data, u64 *val)
+{
+	*val = atomic64_read(data);
+	return 0;
+}
+
+static int ra_debugfs_counter_set(void *data, u64 val)
+{
+	atomic64_set(data, 0);
+	return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(ra_debugfs_counter_fops, ra_debugfs_counter_get,
+			 ra_debugfs_counter_set, "%llu\n");
+
+/**
+ * @brief Display the read latency histogram in debugfs.
+ *
+ * One line per non-empty bucket: lower bound (ns), upper bound (ns), count.
+ *
+ * @param s: sequential file being produced
+ * @param unused: ignored
+ *
+ * @return: 0.
+ */
+static int ra_latency_show(struct seq_file *s, void *unused)
+{
+	struct priv *priv = s->private;
+	unsigned int i;
+	u64 count;
+
+	for (i = 0; i < LAT_BUCKETS; ++i) {
+		count = atomic64_read(&priv->stats.lat_hist[i]);
+		if (!count)
+			continue;
+		if (i == LAT_BUCKETS - 1)
+			seq_printf(s, "%llu - inf: %llu\n", 1ULL << i, count);
+		else
+			seq_printf(s, "%llu - %llu: %llu\n", 1ULL << i,
+				   (1ULL << (i + 1)) - 1, count);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ra_latency);
+
+/**
+ * @brief Create our debugfs directory.
+ *
+ * debugfs is a debugging aid: failures are not reported, and the driver works
+ * the same without it.
+ *
+ * @param priv: pointer to driver's private data
+ */
+static void ra_debugfs_init(struct priv *priv)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "reds_adder-%s", dev_name(priv->dev));
+	priv->debugfs = debugfs_create_dir(name, NULL);
+
+	debugfs_create_file_unsafe("irq_count", 0600, priv->debugfs,
+				   &priv->stats.irqs, &ra_debugfs_counter_fops);
+	debugfs_create_file_unsafe("bytes_processed", 0600, priv->debugfs,
+				   &priv->stats.bytes, &ra_debugfs_counter_fops);
+	debugfs_create_file_unsafe("mutex_wait_ns", 0600, priv->debugfs,
+				   &priv->stats.mutex_wait_ns,
+				   &ra_debugfs_counter_fops);
+	debugfs_create_file("read_latency_hist", 0400, priv->debugfs, priv,
+			    &ra_latency_fops);
 }
 
 /**
@@ -721,15 +2651,20 @@ irq_handler_t irq_handler(int irq, void *dev_id)
 	/* We cast back the parameter to get our private data. */
 	struct priv *priv = (struct priv *)dev_id;
 
-	dev_info(
-		priv->dev,
-		"called %s()--- shouldn't print in an interrupt in real life, but this useful for debugging/understanding\n",
-		__func__);
+	/*
+	 * No printing here: it would slow down every single interrupt. The
+	 * ra_irq trace event and the debugfs counter tell us what we need.
+	 */
+	trace_ra_irq(priv->dev, irq);
+	atomic64_inc(&priv->stats.irqs);
 
 	/* Reinitialize the counter and acknowledge the interrupt. */
 	ra_write(priv, INIT_REG_OFF, REINIT_CNT);
 	ra_write(priv, IRQ_CAPT_REG_OFF, ACK_IRQ);
 
+	/* Let the engine go on with the next value. */
+	complete(&priv->irq_done);
+
 	/*
 	 * We successfully handled the interrupt, so we inform the kernel that
 	 * we're ok.
@@ -737,6 +2672,35 @@ irq_handler_t irq_handler(int irq, void *dev_id)
 	return (irq_handler_t)IRQ_HANDLED;
 }
 
+/**
+ * @brief Free the private data of a device, once its last reference is gone.
+ *
+ * @param kobj: kobject embedded in the private data
+ */
+static void ra_priv_release(struct kobject *kobj)
+{
+	struct priv *priv = container_of(kobj, struct priv, kobj);
+
+	put_device(priv->dev);
+	kfree(priv);
+}
+
+static const struct kobj_type ra_priv_ktype = {
+	.release = ra_priv_release,
+};
+
+/**
+ * @brief Drop the reference the device holds on its private data.
+ *
+ * @param data: pointer to driver's private data
+ */
+static void ra_priv_put(void *data)
+{
+	struct priv *priv = data;
+
+	kobject_put(&priv->kobj);
+}
+
 /**
  * @brief Driver's probe function.
 
@@ -774,12 +2738,27 @@ static int reds_adder_probe(struct platform_device *pdev)
 	 * backtracking my subsequent commands...").
 	 * We use kzalloc() instead of kmalloc() since zeroing out memory is
 	 * always best  (if we can afford it).
+	 * It is not a devm_kzalloc(): the files still open when the device is
+	 * removed keep using it, it is reference counted instead. Our own
+	 * reference is dropped along with the other devm_X() resources (and
+	 * after them, as it comes first).
 	 */
-	priv = devm_kzalloc(&pdev->dev, sizeof(*priv), GFP_KERNEL);
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
 	if (unlikely(!priv)) {
 		rc = -ENOMEM;
 		goto return_fail;
 	}
+	/*
+	 * We sometimes need a pointer to the device (e.g., for printing messages
+	 * with dev_X()), and so we store it in our private data to ensure that
+	 * we have it in whatever function we end up with. It must outlive the
+	 * private data.
+	 */
+	priv->dev = get_device(&pdev->dev);
+	kobject_init(&priv->kobj, &ra_priv_ktype);
+	rc = devm_add_action_or_reset(&pdev->dev, ra_priv_put, priv);
+	if (rc)
+		goto return_fail;
 	/*
 	 * This call stores the pointer to our private data in the platform
 	 * device. This allows to retrieve this pointer in functions that we do
@@ -787,28 +2766,41 @@ static int reds_adder_probe(struct platform_device *pdev)
 	 * such as the module's remove function.
 	 */
 	platform_set_drvdata(pdev, priv);
+
 	/*
-	 * We sometimes need a pointer to the device (e.g., for printing messages
-	 * with dev_X()), and so we store it in our private data to ensure that
-	 * we have it in whatever function we end up with.
+	 * Size of the KFIFOs, as a power of 2 within reasonable bounds. The DT
+	 * can ask for a given size, otherwise the module parameter is used.
 	 */
-	priv->dev = &pdev->dev;
-
+	if (device_property_read_u32(&pdev->dev, "reds,fifo-size",
+				     &priv->fifo_size))
+		priv->fifo_size = fifo_size;
+	priv->fifo_size = roundup_pow_of_two(clamp_t(
+		unsigned int, priv->fifo_size, sizeof(int), MAX_FIFO_SIZE));
 	/* Set the threshold to its default value. */
-	priv->threshold = DEFAULT_THR;
+	priv->config.threshold = DEFAULT_THR;
 	/* The default operation is encryption. */
-	priv->encrypt = true;
-	/* Initialize the read mutex. */
-	mutex_init(&priv->read_mutex);
-	/* Initialize the wait-queue used for blocking read()s. */
-	init_waitqueue_head(&priv->read_queue);
-	/* Initialize the KFIFO used to store the data. */
-	rc = kfifo_alloc(&priv->data_fifo, MAX_VEC_LEN * sizeof(int),
-			 GFP_KERNEL);
-	if (rc) {
-		dev_err(&pdev->dev, "Failed to allocate the KFIFO!\n");
-		rc = -ENOMEM;
-		goto free_kfifo;
+	priv->config.encrypt = true;
+	/* The values are read from the device unless asked otherwise. */
+	priv->config.fast = false;
+	priv->config.fast_sample = DEFAULT_FAST_SAMPLE;
+	priv->slice = DEFAULT_SLICE;
+	/* Initialize the lock of the configuration. */
+	seqlock_init(&priv->config_lock);
+	/* Initialize the engine's list of contexts and synchronization. */
+	init_waitqueue_head(&priv->engine_queue);
+	spin_lock_init(&priv->req_lock);
+	INIT_LIST_HEAD(&priv->active_list);
+	INIT_LIST_HEAD(&priv->pool_node);
+	init_completion(&priv->irq_done);
+
+	/*
+	 * A device registered by the emulator (reds_adder_emu.ko) has no
+	 * registers to map, it comes with its accessors as platform data.
+	 */
+	priv->emu = dev_get_platdata(&pdev->dev);
+	if (priv->emu) {
+		dev_info(&pdev->dev, "Using the emulated REDS-adder\n");
+		goto create_sysfs_group;
 	}
 
 	/*
@@ -819,7 +2811,7 @@ static int reds_adder_probe(struct platform_device *pdev)
 		dev_err(&pdev->dev,
 			"Failed to get memory resource from device tree!\n");
 		rc = -EINVAL;
-		goto free_kfifo;
+		goto return_fail;
 	}
 
 	/*
@@ -830,14 +2822,15 @@ static int reds_adder_probe(struct platform_device *pdev)
 	if (IS_ERR(priv->MEM_ptr)) {
 		dev_err(&pdev->dev, "Failed to map memory!\n");
 		rc = PTR_ERR(priv->MEM_ptr);
-		goto free_kfifo;
+		goto return_fail;
 	}
 
+create_sysfs_group:
 	/* Create our sysfs group entry. */
 	rc = sysfs_create_group(&pdev->dev.kobj, &ra_device_attribute_group);
 	if (rc) {
 		dev_err(&pdev->dev, "Failed to create a sysfs group for RA!\n");
-		goto free_kfifo;
+		goto return_fail;
 	}
 
 	/*
@@ -883,6 +2876,20 @@ static int reds_adder_probe(struct platform_device *pdev)
 	ra_write(priv, THRESH_REG_OFF, DEFAULT_THR);
 	ra_write(priv, IRQ_MASK_REG_OFF, INT_ENABLE);
 	ra_write(priv, INCR_REG_OFF, INCR_ENABLE);
+	ra_write(priv, INIT_REG_OFF, REINIT_CNT);
+	priv->hw_threshold = DEFAULT_THR;
+	priv->hw_pos = 0;
+
+	/*
+	 * The hardware is ready, we can start the engine that will feed it with
+	 * the requests.
+	 */
+	priv->engine = kthread_run(ra_engine, priv, "ra_engine");
+	if (IS_ERR(priv->engine)) {
+		dev_err(&pdev->dev, "Failed to start the engine thread !\n");
+		rc = PTR_ERR(priv->engine);
+		goto disable_irq;
+	}
 
 	/*
 	 * We now have to prepare the device file and register the associated
@@ -892,31 +2899,17 @@ static int reds_adder_probe(struct platform_device *pdev)
 	 * associated functions.
 	 */
 	/*
-	 * Get a major and minor number from the kernel. This is way better than
-	 * imposing these values by ourselves (Murphy's law will otherwise ensure
-	 * that these values are already taken!).
-	 */
-	rc = alloc_chrdev_region(
-		&priv->dev_num, /* Will contain the assigned numbers */
-		0, /* First minor we request */
-		1, /* Number of minors we want */
-		DEV_NAME); /* Name of the device */
-	if (rc != 0) {
-		dev_err(&pdev->dev, "Cannot get a major/minor number pair !\n");
-		goto destroy_sysfs_group;
-	}
-	/*
-	 * We then have to create a class for our device (which will be visible in
-	 * /sys/class). A class in an abstraction of our device. Example classes
-	 * could be 'disk' and 'printer'.
-	 * More details here:
-	 * https://static.lwn.net/kerneldoc/driver-api/infrastructure.html#c.class
+	 * The major number and the class were set up when the module was
+	 * loaded (see ra_init()), shared by all the devices: we only need a
+	 * minor number of our own. It also gives the name of the device file.
 	 */
-	priv->dev_class = class_create(THIS_MODULE, "ra");
-	if (!priv->dev_class) {
-		dev_err(&pdev->dev, "Failed to allocate device's class !\n");
-		goto free_chrdev;
+	rc = ida_alloc_max(&ra_pool.minors, MAX_DEVICES - 1, GFP_KERNEL);
+	if (rc < 0) {
+		dev_err(&pdev->dev, "Too many REDS-adders !\n");
+		goto stop_engine;
 	}
+	priv->minor = rc;
+	priv->dev_num = MKDEV(MAJOR(ra_pool.devt), priv->minor);
 
 	/*
 	 * Initialize a cdev structure, register the file operations associated
@@ -924,6 +2917,8 @@ static int reds_adder_probe(struct platform_device *pdev)
 	 */
 	cdev_init(&priv->cdev, &ra_fops);
 	priv->cdev.owner = THIS_MODULE;
+	/* Every file open holds the cdev, which holds our private data. */
+	cdev_set_parent(&priv->cdev, &priv->kobj);
 
 	/* We can now add the character device. */
 	rc = cdev_add(&priv->cdev, /* This is our handle to the cdev */
@@ -931,18 +2926,18 @@ static int reds_adder_probe(struct platform_device *pdev)
 		      1); /* Number of minors to be added */
 	if (rc != 0) {
 		dev_err(&pdev->dev, "Failed to add cdev !\n");
-		goto free_cdev;
+		goto free_minor;
 	}
 
 	/*
 	 * We can finally create the device file in /dev and register it in sysfs.
 	 */
-	priv->dev_file = device_create(priv->dev_class, /* Device's class */
+	priv->dev_file = device_create(ra_pool.class, /* Device's class */
 				       priv->dev, /* Parent device */
 				       priv->dev_num, /* Major/minor numbers */
 				       priv, /* Pointer to private data */
 				       "reds-adder%d",
-				       0); /* Device file's name */
+				       priv->minor); /* Device file's name */
 	/*
 	 * IS_ERR() is a macro that allows to test a pointer to check whether it's
 	 * valid or not.
@@ -950,23 +2945,31 @@ static int reds_adder_probe(struct platform_device *pdev)
 	 */
 	if (IS_ERR(priv->dev_file)) {
 		dev_err(&pdev->dev, "Failed to create device file !\n");
+		rc = PTR_ERR(priv->dev_file);
 		goto delete_cdev;
 	}
 
+	ra_debugfs_init(priv);
+
+	/* The device is ready, the pool can use it. */
+	mutex_lock(&ra_pool.lock);
+	list_add(&priv->pool_node, &ra_pool.devices);
+	mutex_unlock(&ra_pool.lock);
+
 	dev_info(&pdev->dev, "REDS-adder ready !\n");
 
 	return 0;
 
 delete_cdev:
 	cdev_del(&priv->cdev);
-free_cdev:
-	class_destroy(priv->dev_class);
-free_chrdev:
-	unregister_chrdev(MAJOR(priv->dev_num), DEV_NAME);
+free_minor:
+	ida_free(&ra_pool.minors, priv->minor);
+stop_engine:
+	kthread_stop(priv->engine);
+disable_irq:
+	ra_write(priv, IRQ_MASK_REG_OFF, INT_DISABLE);
 destroy_sysfs_group:
 	sysfs_remove_group(&pdev->dev.kobj, &ra_device_attribute_group);
-free_kfifo:
-	kfree(priv);
 return_fail:
 	return rc;
 }
@@ -995,8 +2998,13 @@ static int reds_adder_remove(struct platform_device *pdev)
 
 	dev_info(&pdev->dev, "Removing driver...\n");
 
-	/* Disable further interrupts. */
-	ra_write(priv, IRQ_MASK_REG_OFF, INT_DISABLE);
+	/* The pool must not hand us anything anymore. */
+	mutex_lock(&ra_pool.lock);
+	list_del(&priv->pool_node);
+	mutex_unlock(&ra_pool.lock);
+
+	debugfs_remove_recursive(priv->debugfs);
+	sysfs_remove_group(&pdev->dev.kobj, &ra_device_attribute_group);
 
 	/*
 	 * Unsurprisingly, the operations below are the same we perform in the
@@ -1004,15 +3012,42 @@ static int reds_adder_remove(struct platform_device *pdev)
 	 * We are lucky, most of the stuff is taken care of by the devm_X()
 	 * functions.
 	 */
-	/* Destroy the device in /dev. */
-	device_destroy(priv->dev_class, priv->dev_num);
+	/* Destroy the device in /dev, so that it cannot be opened anymore. */
+	device_destroy(ra_pool.class, priv->dev_num);
 	cdev_del(&priv->cdev);
-	/* No other devices use this same class, so we can delete it. */
-	class_destroy(priv->dev_class);
-	/* De-register the character device. */
-	unregister_chrdev(MAJOR(priv->dev_num), DEV_NAME);
-	/* Free KFIFO memory. */
-	kfifo_free(&priv->data_fifo);
+
+	/*
+	 * Files already open can still submit requests (the private data lives
+	 * until the last one is closed): from now on they fail with -ENODEV
+	 * instead of waiting for an engine that is gone.
+	 */
+	spin_lock(&priv->req_lock);
+	priv->dead = true;
+	spin_unlock(&priv->req_lock);
+
+	/*
+	 * Only then stop the engine: it might be waiting for an interrupt.
+	 * Requests still pending are failed with -ENODEV.
+	 */
+	kthread_stop(priv->engine);
+
+	/* Disable further interrupts. */
+	ra_write(priv, IRQ_MASK_REG_OFF, INT_DISABLE);
+
+	/*
+	 * The class is shared by all the devices, only our minor goes back.
+	 * The pool's lanes are indexed by minor number, so a device probed
+	 * later may reuse ours: they must be idle by then. The pool cannot
+	 * queue on them anymore and the engine unlinked them all when it
+	 * stopped, unless it was stopped before it even ran: drain them
+	 * under the pool's lock (which the dispatch holds) and check it.
+	 */
+	mutex_lock(&ra_pool.lock);
+	ra_engine_drop(priv);
+	WARN_ON(!list_empty(&priv->active_list));
+	WARN_ON(atomic_read(&priv->load));
+	ida_free(&ra_pool.minors, priv->minor);
+	mutex_unlock(&ra_pool.lock);
 
 	return 0;
 }
@@ -1047,7 +3082,539 @@ static struct platform_driver reds_adder_driver = {
 	};
 
 /*
- * We declare this as a platform driver. As a benefit, we get the init and exit
- * functions (that will take care of the register/unregister operations) for free.
+ * The kernel crypto API front-end needs the crypto engine, which is optional:
+ * without it, the devices are only reachable through their device files.
+ */
+#if IS_REACHABLE(CONFIG_CRYPTO_ENGINE) && IS_REACHABLE(CONFIG_CRYPTO_SKCIPHER)
+
+/**
+ * @struct ra_crypto
+ * @brief State of the kernel crypto API front-end.
+ *
+ * The requests of the kernel users (and of user space, through AF_ALG) are
+ * queued by a crypto engine, which hands them over to us one at a time from
+ * its own thread. Each of them is turned into pieces that are only collected;
+ * once the engine's queue is empty, the whole batch is spread over the devices
+ * of the pool at once. The requests are completed as soon as their last piece
+ * has been processed, in whatever order the devices finish them.
+ *
+ * @var ra_crypto::engine
+ * Crypto engine queuing the requests.
+ * @var ra_crypto::lanes
+ * One queue per device, as for a pool's context.
+ * @var ra_crypto::batch
+ * Pieces collected and not dispatched yet (only touched by the crypto engine's
+ * thread).
+ */
+struct ra_crypto {
+	struct crypto_engine *engine;
+	struct ra_queue lanes[MAX_DEVICES];
+	struct list_head batch;
+};
+
+static struct ra_crypto ra_crypto;
+
+/**
+ * @struct ra_crypto_tfm_ctx
+ * @brief Context of a transformation (i.e., of a key).
+ *
+ * @var ra_crypto_tfm_ctx::enginectx
+ * Crypto engine's operations, MUST be the first member.
+ * @var ra_crypto_tfm_ctx::threshold
+ * Threshold given as the key.
+ */
+struct ra_crypto_tfm_ctx {
+	struct crypto_engine_ctx enginectx;
+	u32 threshold;
+};
+
+/**
+ * @struct ra_crypto_req_ctx
+ * @brief Context of a request, from its submission to the engine on.
+ *
+ * @var ra_crypto_req_ctx::encrypt
+ * Operation to perform (encrypt when true, decrypt when false).
+ */
+struct ra_crypto_req_ctx {
+	bool encrypt;
+};
+
+/**
+ * @struct ra_crypto_job
+ * @brief A request of the crypto API, while the devices process it.
+ *
+ * The scatterlists are copied to (and from) a linear buffer, which the pieces
+ * point into.
+ *
+ * @var ra_crypto_job::sreq
+ * Request of the crypto API.
+ * @var ra_crypto_job::pending
+ * Number of pieces not processed yet.
+ * @var ra_crypto_job::status
+ * First error of a piece, 0 if none.
+ * @var ra_crypto_job::len
+ * Number of integers of the request.
+ * @var ra_crypto_job::pieces
+ * Pieces submitted to the devices.
+ * @var ra_crypto_job::buf
+ * Linear copy of the data.
+ */
+struct ra_crypto_job {
+	struct skcipher_request *sreq;
+	atomic_t pending;
+	int status;
+	size_t len;
+	struct ra_req *pieces;
+	int *buf;
+};
+
+/**
+ * @brief Free a job (whatever has been allocated of it).
+ *
+ * @param job: job to free
+ */
+static void ra_crypto_job_free(struct ra_crypto_job *job)
+{
+	kvfree(job->buf);
+	kfree(job->pieces);
+	kfree(job);
+}
+
+/**
+ * @brief Called by the engine of a device once a piece has been processed.
+ *
+ * The last piece of a request hands the results back to the crypto API.
+ *
+ * @param piece: piece processed (or dropped)
+ */
+static void ra_crypto_piece_end(struct ra_req *piece)
+{
+	struct ra_crypto_job *job = piece->owner;
+	struct skcipher_request *sreq = job->sreq;
+	int status;
+
+	if (piece->status)
+		cmpxchg(&job->status, 0, piece->status);
+	if (!atomic_dec_and_test(&job->pending))
+		return;
+
+	status = job->status;
+	if (!status) {
+		sg_copy_from_buffer(sreq->dst, sg_nents(sreq->dst), job->buf,
+				    sreq->cryptlen);
+		/* As with CTR, the IV moves on to the next integer. */
+		put_unaligned_le64(get_unaligned_le64(sreq->iv) + job->len,
+				   sreq->iv);
+	}
+	ra_crypto_job_free(job);
+
+	crypto_finalize_skcipher_request(ra_crypto.engine, sreq, status);
+}
+
+/**
+ * @brief Prepare a request handed over by the crypto engine.
+ *
+ * The request is split into pieces, as the pool does with a long vector, and
+ * the pieces are added to the batch. They only reach the devices in
+ * ra_crypto_do_batch().
+ *
+ * @param engine: crypto engine
+ * @param areq: request of the crypto API
+ *
+ * @return: 0 on success, a negative error code otherwise (the engine then
+ * completes the request with it).
+ */
+static int ra_crypto_do_one(struct crypto_engine *engine, void *areq)
+{
+	struct skcipher_request *sreq =
+		container_of(areq, struct skcipher_request, base);
+	struct ra_crypto_tfm_ctx *tctx =
+		crypto_skcipher_ctx(crypto_skcipher_reqtfm(sreq));
+	struct ra_crypto_req_ctx *rctx = skcipher_request_ctx(sreq);
+	struct ra_crypto_job *job;
+	struct ra_config config;
+	struct ra_req *piece;
+	unsigned int nr;
+	unsigned int i;
+	u64 pos;
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+
+	job->sreq = sreq;
+	job->len = sreq->cryptlen / sizeof(int);
+	nr = DIV_ROUND_UP(job->len, POOL_PIECE_LEN);
+	job->pieces = kcalloc(nr, sizeof(*job->pieces), GFP_KERNEL);
+	job->buf = kvmalloc(sreq->cryptlen, GFP_KERNEL);
+	if (!job->pieces || !job->buf) {
+		ra_crypto_job_free(job);
+		return -ENOMEM;
+	}
+	sg_copy_to_buffer(sreq->src, sg_nents(sreq->src), job->buf,
+			  sreq->cryptlen);
+	atomic_set(&job->pending, nr);
+
+	/* The mode is the one selected for the pool, through its sysfs. */
+	ra_config_get(ra_pool.priv, &config);
+
+	pos = get_unaligned_le64(sreq->iv);
+	for (i = 0; i < nr; ++i) {
+		piece = &job->pieces[i];
+		piece->encrypt = rctx->encrypt;
+		piece->threshold = tctx->threshold;
+		piece->fast = config.fast;
+		piece->sample = config.fast_sample;
+		piece->version = config.version;
+		piece->pos = pos + i * POOL_PIECE_LEN;
+		piece->nr_segs = 1;
+		piece->segs[0].data = job->buf + i * POOL_PIECE_LEN;
+		piece->segs[0].len = min_t(size_t, job->len - i * POOL_PIECE_LEN,
+					   POOL_PIECE_LEN);
+		piece->end = ra_crypto_piece_end;
+		piece->owner = job;
+		list_add_tail(&piece->node, &ra_crypto.batch);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Hand the batch over to the devices.
+ *
+ * Called by the crypto engine once it has no more requests for us.
+ *
+ * @param engine: crypto engine
+ *
+ * @return: 0.
+ */
+static int ra_crypto_do_batch(struct crypto_engine *engine)
+{
+	if (!list_empty(&ra_crypto.batch))
+		ra_pool_dispatch(ra_crypto.lanes, &ra_crypto.batch);
+
+	return 0;
+}
+
+/**
+ * @brief Set the key (i.e., the threshold) of a transformation.
+ *
+ * @param tfm: transformation
+ * @param key: threshold, as a 32-bit little-endian integer
+ * @param keylen: size of the key
+ *
+ * @return: 0 on success, -EINVAL if the key is not a valid threshold.
+ */
+static int ra_crypto_setkey(struct crypto_skcipher *tfm, const u8 *key,
+			    unsigned int keylen)
+{
+	struct ra_crypto_tfm_ctx *tctx = crypto_skcipher_ctx(tfm);
+	u32 threshold;
+
+	if (keylen != RA_CRYPTO_KEY_SIZE)
+		return -EINVAL;
+	threshold = get_unaligned_le32(key);
+	if (threshold == 0 || threshold > INT_MAX)
+		return -EINVAL;
+
+	tctx->threshold = threshold;
+	return 0;
+}
+
+/**
+ * @brief Submit a request to the crypto engine.
+ *
+ * @param sreq: request of the crypto API
+ * @param encrypt: encrypt when true, decrypt when false
+ *
+ * @return: -EINPROGRESS (or -EBUSY if backlogged) once queued, 0 if there is
+ * nothing to do, a negative error code otherwise.
+ */
+static int ra_crypto_crypt(struct skcipher_request *sreq, bool encrypt)
+{
+	struct ra_crypto_req_ctx *rctx = skcipher_request_ctx(sreq);
+
+	if (sreq->cryptlen % sizeof(int))
+		return -EINVAL;
+	if (sreq->cryptlen == 0)
+		return 0;
+
+	rctx->encrypt = encrypt;
+	return crypto_transfer_skcipher_request_to_engine(ra_crypto.engine,
+							  sreq);
+}
+
+static int ra_crypto_encrypt(struct skcipher_request *sreq)
+{
+	return ra_crypto_crypt(sreq, true);
+}
+
+static int ra_crypto_decrypt(struct skcipher_request *sreq)
+{
+	return ra_crypto_crypt(sreq, false);
+}
+
+/**
+ * @brief Initialize a new transformation.
+ *
+ * @param tfm: transformation
+ *
+ * @return: 0.
+ */
+static int ra_crypto_init_tfm(struct crypto_skcipher *tfm)
+{
+	struct ra_crypto_tfm_ctx *tctx = crypto_skcipher_ctx(tfm);
+
+	tctx->enginectx.op.do_one_request = ra_crypto_do_one;
+	tctx->threshold = DEFAULT_THR;
+	crypto_skcipher_set_reqsize(tfm, sizeof(struct ra_crypto_req_ctx));
+
+	return 0;
+}
+
+static struct skcipher_alg ra_crypto_alg = {
+	.base = {
+		.cra_name = RA_CRYPTO_ALG,
+		.cra_driver_name = RA_CRYPTO_ALG "-hw",
+		.cra_priority = 300,
+		.cra_flags = CRYPTO_ALG_ASYNC | CRYPTO_ALG_KERN_DRIVER_ONLY,
+		/* The vectors are made of integers. */
+		.cra_blocksize = sizeof(int),
+		.cra_ctxsize = sizeof(struct ra_crypto_tfm_ctx),
+		.cra_module = THIS_MODULE,
+	},
+	.min_keysize = RA_CRYPTO_KEY_SIZE,
+	.max_keysize = RA_CRYPTO_KEY_SIZE,
+	.ivsize = RA_CRYPTO_IV_SIZE,
+	.setkey = ra_crypto_setkey,
+	.encrypt = ra_crypto_encrypt,
+	.decrypt = ra_crypto_decrypt,
+	.init = ra_crypto_init_tfm,
+};
+
+/**
+ * @brief Start the crypto engine and register our algorithm.
+ *
+ * @param dev: device the crypto engine belongs to (the pool's)
+ *
+ * @return: 0 on success, a negative error code otherwise.
+ */
+static int ra_crypto_register(struct device *dev)
+{
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < MAX_DEVICES; ++i) {
+		INIT_LIST_HEAD(&ra_crypto.lanes[i].req_list);
+		INIT_LIST_HEAD(&ra_crypto.lanes[i].active_node);
+	}
+	INIT_LIST_HEAD(&ra_crypto.batch);
+
+	/*
+	 * "Retry support" lets the engine hand us requests while the previous
+	 * ones are still being processed, which is what batching needs.
+	 */
+	ra_crypto.engine = crypto_engine_alloc_init_and_set(
+		dev, true, ra_crypto_do_batch, false, CRYPTO_QUEUE_LEN);
+	if (!ra_crypto.engine) {
+		dev_err(dev, "failed to allocate the crypto engine !\n");
+		return -ENOMEM;
+	}
+
+	rc = crypto_engine_start(ra_crypto.engine);
+	if (rc != 0) {
+		dev_err(dev, "failed to start the crypto engine !\n");
+		goto exit_engine;
+	}
+
+	rc = crypto_register_skcipher(&ra_crypto_alg);
+	if (rc != 0) {
+		dev_err(dev, "failed to register the skcipher !\n");
+		goto exit_engine;
+	}
+
+	return 0;
+
+exit_engine:
+	crypto_engine_exit(ra_crypto.engine);
+	return rc;
+}
+
+/**
+ * @brief Unregister our algorithm and stop the crypto engine.
+ *
+ * A transformation holds a reference to the module, so nobody can still be
+ * using the algorithm (and no request can be in flight) at this point.
+ */
+static void ra_crypto_unregister(void)
+{
+	crypto_unregister_skcipher(&ra_crypto_alg);
+	crypto_engine_exit(ra_crypto.engine);
+}
+
+#else /* !CONFIG_CRYPTO_ENGINE */
+
+static int ra_crypto_register(struct device *dev)
+{
+	return 0;
+}
+
+static void ra_crypto_unregister(void)
+{
+}
+
+#endif /* CONFIG_CRYPTO_ENGINE */
+
+/* The pool's device file has the same sysfs attributes as a device. */
+static const struct attribute_group *ra_pool_groups[] = {
+	&ra_device_attribute_group,
+	NULL,
+};
+
+/**
+ * @brief Create the pool and its device file.
+ *
+ * @return: 0 on success, a negative error code otherwise.
+ */
+static int ra_pool_create(void)
+{
+	struct priv *priv;
+	int rc;
+
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+
+	/* Same default configuration as a device. */
+	priv->pool = true;
+	priv->fifo_size = roundup_pow_of_two(
+		clamp_t(unsigned int, fifo_size, sizeof(int), MAX_FIFO_SIZE));
+	priv->config.threshold = DEFAULT_THR;
+	priv->config.encrypt = true;
+	priv->config.fast = false;
+	priv->config.fast_sample = DEFAULT_FAST_SAMPLE;
+	priv->slice = DEFAULT_SLICE;
+	seqlock_init(&priv->config_lock);
+
+	priv->minor = MAX_DEVICES;
+	priv->dev_num = MKDEV(MAJOR(ra_pool.devt), priv->minor);
+	cdev_init(&priv->cdev, &ra_fops);
+	priv->cdev.owner = THIS_MODULE;
+	rc = cdev_add(&priv->cdev, priv->dev_num, 1);
+	if (rc != 0) {
+		pr_err("REDS-adder: failed to add the pool's cdev !\n");
+		goto free_priv;
+	}
+
+	/* The pool has no platform device, its device file is its device. */
+	priv->dev_file = device_create_with_groups(ra_pool.class, NULL,
+						   priv->dev_num, priv,
+						   ra_pool_groups, POOL_NAME);
+	if (IS_ERR(priv->dev_file)) {
+		pr_err("REDS-adder: failed to create the pool's device file !\n");
+		rc = PTR_ERR(priv->dev_file);
+		goto delete_cdev;
+	}
+	priv->dev = priv->dev_file;
+
+	ra_pool.priv = priv;
+	return 0;
+
+delete_cdev:
+	cdev_del(&priv->cdev);
+free_priv:
+	kfree(priv);
+	return rc;
+}
+
+/**
+ * @brief Destroy the pool and its device file.
+ */
+static void ra_pool_destroy(void)
+{
+	struct priv *priv = ra_pool.priv;
+
+	device_destroy(ra_pool.class, priv->dev_num);
+	cdev_del(&priv->cdev);
+	kfree(priv);
+}
+
+/**
+ * @brief Module initialization.
+ *
+ * We used to rely on module_platform_driver(), but what is shared by all the
+ * devices (major number, class, pool) has to be set up before the first probe()
+ * and torn down after the last remove().
+ *
+ * @return: 0 on success, a negative error code otherwise.
+ */
+static int __init ra_init(void)
+{
+	int rc;
+
+	/*
+	 * Get a major number and a range of minor numbers from the kernel. This
+	 * is way better than imposing these values by ourselves (Murphy's law
+	 * will otherwise ensure that these values are already taken!).
+	 */
+	rc = alloc_chrdev_region(&ra_pool.devt, 0, MAX_DEVICES + 1, DEV_NAME);
+	if (rc != 0) {
+		pr_err("REDS-adder: cannot get a major/minor number range !\n");
+		return rc;
+	}
+
+	/*
+	 * We then have to create a class for our devices (which will be visible
+	 * in /sys/class). A class in an abstraction of our device. Example
+	 * classes could be 'disk' and 'printer'.
+	 * More details here:
+	 * https://static.lwn.net/kerneldoc/driver-api/infrastructure.html#c.class
+	 */
+	ra_pool.class = class_create(THIS_MODULE, "ra");
+	if (IS_ERR(ra_pool.class)) {
+		pr_err("REDS-adder: failed to allocate device's class !\n");
+		rc = PTR_ERR(ra_pool.class);
+		goto free_chrdev;
+	}
+
+	rc = ra_pool_create();
+	if (rc != 0)
+		goto destroy_class;
+
+	rc = platform_driver_register(&reds_adder_driver);
+	if (rc != 0)
+		goto destroy_pool;
+
+	/* The requests of the crypto API go to the pool's devices. */
+	rc = ra_crypto_register(ra_pool.priv->dev);
+	if (rc != 0)
+		goto unregister_driver;
+
+	return 0;
+
+unregister_driver:
+	platform_driver_unregister(&reds_adder_driver);
+destroy_pool:
+	ra_pool_destroy();
+destroy_class:
+	class_destroy(ra_pool.class);
+free_chrdev:
+	unregister_chrdev_region(ra_pool.devt, MAX_DEVICES + 1);
+	return rc;
+}
+
+/**
+ * @brief Module exit: every device is removed before the shared state.
  */
-module_platform_driver(reds_adder_driver);
+static void __exit ra_exit(void)
+{
+	ra_crypto_unregister();
+	platform_driver_unregister(&reds_adder_driver);
+	ra_pool_destroy();
+	class_destroy(ra_pool.class);
+	unregister_chrdev_region(ra_pool.devt, MAX_DEVICES + 1);
+	ida_destroy(&ra_pool.minors);
+}
+
+module_init(ra_init);
+module_exit(ra_exit);
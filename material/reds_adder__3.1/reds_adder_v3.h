@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * REDS-adder driver, v3.1 --- interface shared with user space.
+ *
+ * This header is included both by the driver and by the user space programs,
+ * so it must only rely on the fixed-size types from <linux/types.h>.
+ */
+#ifndef REDS_ADDER_V3_H
+#define REDS_ADDER_V3_H
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#else
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#endif
+
+/**
+ * @struct ra_ring_hdr
+ * @brief Header of the ring shared between the driver and user space.
+ *
+ * The ring is obtained by mmap()ing the device file at offset 0, for
+ * 'map_size' bytes. The header lives at the very beginning of the mapping and
+ * the 'entries' integer slots start 'data_offset' bytes after it.
+ *
+ * Values are processed in place: user space stores the values to
+ * encrypt/decrypt in the slots starting at 'prod' and then advances 'prod';
+ * after a RA_IOC_RING_KICK the driver has replaced every slot before 'done'
+ * with its result. Indices are free-running, the slot of index 'i' is
+ * 'i & (entries - 1)'. User space must never let 'prod' run more than
+ * 'entries' slots ahead of the oldest result it has not consumed yet.
+ *
+ * @var ra_ring_hdr::entries
+ * Number of integer slots in the ring (power of 2, set by the driver).
+ * @var ra_ring_hdr::data_offset
+ * Offset in bytes of the first slot in the mapping (set by the driver).
+ * @var ra_ring_hdr::map_size
+ * Size in bytes of the whole mapping (set by the driver).
+ * @var ra_ring_hdr::prod
+ * Index of the next slot user space will fill (written by user space).
+ * @var ra_ring_hdr::done
+ * Index of the first slot not yet processed (written by the driver).
+ */
+struct ra_ring_hdr {
+	__u32 entries;
+	__u32 data_offset;
+	__u32 map_size;
+	__u32 prod;
+	__u32 done;
+};
+
+/* Operations that can be requested in a batch descriptor or RA_IOC_SET_OP. */
+#define RA_OP_ENCRYPT 0
+#define RA_OP_DECRYPT 1
+/* Use the operation selected through sysfs (RA_IOC_SET_OP only). */
+#define RA_OP_DEVICE  2
+
+/* Maximum number of descriptors in a single batch. */
+#define RA_BATCH_MAX_DESCS  256
+/* Maximum number of integers (all descriptors together) in a single batch. */
+#define RA_BATCH_MAX_VALUES 65536
+
+/**
+ * @struct ra_desc
+ * @brief One vector of a batch.
+ *
+ * Each vector is processed on its own, exactly as if it had been written and
+ * then read back in a single read() (the counter is reset for each of them).
+ *
+ * @var ra_desc::in
+ * User space address of the integers to encrypt/decrypt.
+ * @var ra_desc::out
+ * User space address where the results are stored (can be equal to 'in').
+ * @var ra_desc::len
+ * Number of integers in the vector.
+ * @var ra_desc::op
+ * RA_OP_ENCRYPT or RA_OP_DECRYPT.
+ */
+struct ra_desc {
+	__u64 in;
+	__u64 out;
+	__u32 len;
+	__u32 op;
+};
+
+/**
+ * @struct ra_batch
+ * @brief Argument of the RA_IOC_BATCH ioctl.
+ *
+ * @var ra_batch::descs
+ * User space address of an array of 'count' descriptors.
+ * @var ra_batch::count
+ * Number of descriptors in the array.
+ * @var ra_batch::pad
+ * Must be 0.
+ */
+struct ra_batch {
+	__u64 descs;
+	__u32 count;
+	__u32 pad;
+};
+
+#define RA_IOC_MAGIC	  'r'
+/*
+ * Doorbell: process every slot between 'done' and 'prod'. Returns the number
+ * of slots processed.
+ */
+#define RA_IOC_RING_KICK _IO(RA_IOC_MAGIC, 0)
+/*
+ * Process a whole batch of vectors in a single call. Returns the number of
+ * descriptors processed.
+ */
+#define RA_IOC_BATCH	 _IOW(RA_IOC_MAGIC, 1, struct ra_batch)
+/*
+ * Select the operation performed by read()s and by the ring of this open file
+ * (the argument is one of the RA_OP_XXX values, RA_OP_DEVICE by default).
+ */
+#define RA_IOC_SET_OP	 _IO(RA_IOC_MAGIC, 2)
+
+/*
+ * The driver also registers a skcipher with the kernel crypto API, reachable
+ * from user space through AF_ALG (salg_type "skcipher", salg_name RA_CRYPTO_ALG).
+ * The key is the threshold (32-bit, little-endian, > 0) and the IV is the
+ * position of the first integer in the counter's sequence (64-bit,
+ * little-endian). As with CTR, the IV is advanced by the number of integers
+ * processed, so that consecutive requests make up a single stream. The length
+ * of a request must be a multiple of the size of an integer.
+ */
+#define RA_CRYPTO_ALG	   "reds-adder"
+#define RA_CRYPTO_KEY_SIZE 4
+#define RA_CRYPTO_IV_SIZE  8
+
+#endif /* REDS_ADDER_V3_H */
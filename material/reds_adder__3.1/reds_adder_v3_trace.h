@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * REDS-adder driver, v3.1 --- trace events.
+ *
+ * The events are found in /sys/kernel/tracing/events/reds_adder/, e.g.:
+ *   echo 1 > /sys/kernel/tracing/events/reds_adder/enable
+ *   cat /sys/kernel/tracing/trace_pipe
+ * They cost (almost) nothing while disabled.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM reds_adder
+
+#if !defined(REDS_ADDER_V3_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define REDS_ADDER_V3_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+/* A write() stored a vector in the KFIFO of a context. */
+TRACE_EVENT(ra_write_enqueue,
+	TP_PROTO(struct device *dev, const void *ctx, size_t count,
+		 unsigned int queued),
+	TP_ARGS(dev, ctx, count, queued),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(const void *, ctx)
+		__field(size_t, count)
+		__field(unsigned int, queued)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->ctx = ctx;
+		__entry->count = count;
+		__entry->queued = queued;
+	),
+	TP_printk("%s ctx=%p count=%zu queued=%u", __get_str(dev),
+		  __entry->ctx, __entry->count, __entry->queued)
+);
+
+/* A read() starts (before waiting for data or for the other readers). */
+TRACE_EVENT(ra_read_start,
+	TP_PROTO(struct device *dev, const void *ctx, size_t count),
+	TP_ARGS(dev, ctx, count),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(const void *, ctx)
+		__field(size_t, count)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->ctx = ctx;
+		__entry->count = count;
+	),
+	TP_printk("%s ctx=%p count=%zu", __get_str(dev), __entry->ctx,
+		  __entry->count)
+);
+
+/*
+ * The engine processed (a slice of) a request through the device, with the
+ * given version of the configuration.
+ */
+TRACE_EVENT(ra_hw_batch,
+	TP_PROTO(struct device *dev, u64 pos, size_t len, int threshold,
+		 bool encrypt, bool fast, u64 version, u64 duration_ns),
+	TP_ARGS(dev, pos, len, threshold, encrypt, fast, version, duration_ns),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(u64, pos)
+		__field(size_t, len)
+		__field(int, threshold)
+		__field(bool, encrypt)
+		__field(bool, fast)
+		__field(u64, version)
+		__field(u64, duration_ns)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->pos = pos;
+		__entry->len = len;
+		__entry->threshold = threshold;
+		__entry->encrypt = encrypt;
+		__entry->fast = fast;
+		__entry->version = version;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("%s pos=%llu len=%zu threshold=%d op=%s mode=%s config=%llu duration=%lluns",
+		  __get_str(dev), __entry->pos, __entry->len,
+		  __entry->threshold, __entry->encrypt ? "encrypt" : "decrypt",
+		  __entry->fast ? "fast" : "hardware", __entry->version,
+		  __entry->duration_ns)
+);
+
+/* A read() returned its data (or failed, if ret is negative). */
+TRACE_EVENT(ra_read_complete,
+	TP_PROTO(struct device *dev, const void *ctx, ssize_t ret,
+		 u64 latency_ns),
+	TP_ARGS(dev, ctx, ret, latency_ns),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(const void *, ctx)
+		__field(ssize_t, ret)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->ctx = ctx;
+		__entry->ret = ret;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("%s ctx=%p ret=%zd latency=%lluns", __get_str(dev),
+		  __entry->ctx, __entry->ret, __entry->latency_ns)
+);
+
+/* The device raised its threshold interrupt. */
+TRACE_EVENT(ra_irq,
+	TP_PROTO(struct device *dev, int irq),
+	TP_ARGS(dev, irq),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(dev))
+		__field(int, irq)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(dev));
+		__entry->irq = irq;
+	),
+	TP_printk("%s irq=%d", __get_str(dev), __entry->irq)
+);
+
+#endif /* REDS_ADDER_V3_TRACE_H */
+
+/* This part must be outside the include guard. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE reds_adder_v3_trace
+#include <trace/define_trace.h>
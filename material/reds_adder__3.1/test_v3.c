@@ -7,8 +7,18 @@
  * This is expected to block until another write, performed in a thread, unblocks
  * the read and makes the test end.
  *
+ * Finally, the decryption is performed once more through the ring shared with
+ * the driver (mmap() + doorbell ioctl), and both operations are checked through
+ * a single batch ioctl. A non-blocking file is also checked with poll(), and a
+ * single read() much larger than the driver's queue is streamed while a thread
+ * keeps writing small vectors. Last, a vector long enough to be split over
+ * several devices goes through the pool, and then through the kernel crypto API
+ * (AF_ALG), starting in the middle of the counter's sequence. The same vector
+ * is also moved from a pipe to the device and back with splice().
+ *
  * Note: in an industrial setting, a proper test framework should be used !
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -19,9 +29,23 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+
+#include "reds_adder_v3.h"
 
 /* Hardcoded path to our device file. */
 #define DEV_PATH	"/dev/reds-adder0"
+/* Device file spreading the work over all the REDS-adders. */
+#define POOL_PATH	"/dev/reds-adder-pool"
+/* Number of integers processed through the pool. */
+#define POOL_LEN	1024
+/* Number of integers moved through splice() (fits in a pipe). */
+#define SPLICE_LEN	1024
+/* Position of the first integer processed through the crypto API. */
+#define ALG_POS		5
 
 /* Size of the buffer used for read()s.*/
 #define BUF_SIZE	30
@@ -32,6 +56,11 @@
 /* Sleep time before doing the second write. */
 #define SLEEP_TIME	2
 
+/* Number of integers streamed through a single read(). */
+#define STREAM_LEN	16384
+/* Number of integers per write() while streaming. */
+#define STREAM_CHUNK	64
+
 /* Message to encrypt, in char format. */
 char const *msg_char = "AAAAAAAAAAAA";
 
@@ -59,6 +88,95 @@ void *writer_2(void *param)
 	return NULL;
 }
 
+void *writer_stream(void *param)
+{
+	int fd = *(int *)param;
+	int vec[STREAM_CHUNK];
+	int i, j;
+	int rc;
+
+	for (i = 0; i < STREAM_LEN; i += STREAM_CHUNK) {
+		for (j = 0; j < STREAM_CHUNK; ++j) {
+			vec[j] = i + j;
+		}
+		/* The queue may be full, we sleep until the reader makes room. */
+		rc = write(fd, vec, sizeof(vec));
+		assert (rc == sizeof(vec));
+	}
+	return NULL;
+}
+
+/*
+ * Process a vector with the REDS-adder skcipher, through AF_ALG. Returns 0 on
+ * success, -1 if the kernel has no AF_ALG or no REDS-adder skcipher.
+ */
+int crypto_af_alg(int *vec, int len, int op, unsigned long long pos)
+{
+	struct sockaddr_alg sa = {
+		.salg_family = AF_ALG,
+		.salg_type = "skcipher",
+		.salg_name = RA_CRYPTO_ALG,
+	};
+	unsigned char key[RA_CRYPTO_KEY_SIZE];
+	char cbuf[CMSG_SPACE(sizeof(__u32)) +
+		  CMSG_SPACE(sizeof(struct af_alg_iv) + RA_CRYPTO_IV_SIZE)] = {0};
+	struct iovec iov = { .iov_base = vec, .iov_len = len * sizeof(int) };
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct af_alg_iv *iv;
+	int tfm_fd, op_fd;
+	int rc;
+	int i;
+
+	tfm_fd = socket(AF_ALG, SOCK_SEQPACKET, 0);
+	if (tfm_fd == -1)
+		return -1;
+	if (bind(tfm_fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(tfm_fd);
+		return -1;
+	}
+
+	/* The key is the threshold, the IV the position (little-endian). */
+	for (i = 0; i < RA_CRYPTO_KEY_SIZE; ++i) {
+		key[i] = (THR >> (8 * i)) & 0xFF;
+	}
+	rc = setsockopt(tfm_fd, SOL_ALG, ALG_SET_KEY, key, sizeof(key));
+	assert (rc == 0);
+	op_fd = accept(tfm_fd, NULL, 0);
+	assert (op_fd != -1);
+
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_OP;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(__u32));
+	*(__u32 *)CMSG_DATA(cmsg) = op == RA_OP_ENCRYPT ? ALG_OP_ENCRYPT :
+							ALG_OP_DECRYPT;
+
+	cmsg = CMSG_NXTHDR(&msg, cmsg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_IV;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + RA_CRYPTO_IV_SIZE);
+	iv = (struct af_alg_iv *)CMSG_DATA(cmsg);
+	iv->ivlen = RA_CRYPTO_IV_SIZE;
+	for (i = 0; i < RA_CRYPTO_IV_SIZE; ++i) {
+		iv->iv[i] = (pos >> (8 * i)) & 0xFF;
+	}
+
+	rc = sendmsg(op_fd, &msg, 0);
+	assert (rc == len * sizeof(int));
+	rc = read(op_fd, vec, len * sizeof(int));
+	assert (rc == len * sizeof(int));
+
+	close(op_fd);
+	close(tfm_fd);
+	return 0;
+}
+
 int main()
 {
 	int rc;
@@ -71,6 +189,22 @@ int main()
 	pthread_t writer_thread;
 	/* Destination buffer for our read() operations. */
 	int buf[BUF_SIZE+1];
+	/* Ring shared with the driver. */
+	struct ra_ring_hdr *ring;
+	int *slots;
+	unsigned int map_size;
+	/* Batch of two vectors, one encrypted and one decrypted. */
+	struct ra_desc descs[2];
+	struct ra_batch batch;
+	int out[BUF_SIZE];
+	/* Non-blocking file, watched with poll(). */
+	struct pollfd pfd;
+	/* File and destination buffer of the streaming read(). */
+	int stream_fd;
+	int *stream;
+	/* Pipes feeding the device and receiving its results through splice(). */
+	int pipe_in[2];
+	int pipe_out[2];
 
 	data.len = strlen(msg_char);
 
@@ -148,7 +282,7 @@ int main()
 	}
 
 	/* Now switch to decrypt and test this functionality. */
-	fp = fopen("/sys/devices/platform/ff205000.reds-adder/ra_sysfs/operation", "wt");
+	fp = fopen("/sys/class/ra/reds-adder0/device/ra_sysfs/operation", "wt");
 	if (fp == NULL) {
 		fprintf(stderr, "Error opening sysfs file!\n");
 		return -3;
@@ -173,6 +307,162 @@ int main()
 		}
 	}
 
+	/* Map the header first to learn the size of the whole ring. */
+	ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, data.fd, 0);
+	assert (ring != MAP_FAILED);
+	map_size = ring->map_size;
+	munmap(ring, sizeof(*ring));
+	ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, data.fd,
+		    0);
+	assert (ring != MAP_FAILED);
+	slots = (int *)((char *)ring + ring->data_offset);
+
+	/* Decrypt again, this time in place in the shared ring. */
+	for (i = 0; i < sizeof(msg_to_decrypt)/sizeof(int); ++i) {
+		slots[(ring->prod + i) & (ring->entries - 1)] =
+			msg_to_decrypt[i];
+	}
+	__atomic_store_n(&ring->prod, ring->prod + i, __ATOMIC_RELEASE);
+	rc = ioctl(data.fd, RA_IOC_RING_KICK);
+	assert (rc == sizeof(msg_to_decrypt)/sizeof(int));
+	assert (__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) == ring->prod);
+	for (i = 0; i < sizeof(msg_to_decrypt)/sizeof(int); ++i) {
+		assert (slots[(ring->done - rc + i) & (ring->entries - 1)] ==
+			msg_decrypted[i]);
+	}
+	munmap(ring, map_size);
+
+	/* Encrypt and decrypt in a single batch, whatever the current mode. */
+	descs[0].in = (unsigned long)data.msg;
+	descs[0].out = (unsigned long)out;
+	descs[0].len = data.len;
+	descs[0].op = RA_OP_ENCRYPT;
+	descs[1].in = (unsigned long)msg_to_decrypt;
+	descs[1].out = (unsigned long)buf;
+	descs[1].len = sizeof(msg_to_decrypt)/sizeof(int);
+	descs[1].op = RA_OP_DECRYPT;
+	batch.descs = (unsigned long)descs;
+	batch.count = 2;
+	batch.pad = 0;
+	rc = ioctl(data.fd, RA_IOC_BATCH, &batch);
+	assert (rc == 2);
+	{
+		int incr = 1;
+		for (i = 0; i < data.len; ++i, ++incr) {
+			assert (out[i] == data.msg[i]+incr);
+			if (incr == THR) {
+				incr = 0;
+			}
+		}
+		for (i = 0; i < sizeof(msg_to_decrypt)/sizeof(int); ++i) {
+			assert (buf[i] == msg_decrypted[i]);
+		}
+	}
+
+	/* A non-blocking file never sleeps, poll() tells when to come back. */
+	pfd.fd = open(DEV_PATH, O_RDWR | O_NONBLOCK);
+	assert (pfd.fd != -1);
+	pfd.events = POLLIN | POLLOUT;
+	rc = poll(&pfd, 1, 0);
+	assert (rc == 1 && pfd.revents == POLLOUT);
+	rc = read(pfd.fd, buf, sizeof(int));
+	assert (rc == -1 && errno == EAGAIN);
+	rc = write(pfd.fd, data.msg, data.len*sizeof(int));
+	assert (rc == data.len*sizeof(int));
+	rc = poll(&pfd, 1, 0);
+	assert (rc == 1 && pfd.revents == (POLLIN | POLLOUT));
+	rc = read(pfd.fd, buf, data.len*sizeof(int));
+	assert (rc == data.len*sizeof(int));
+	close(pfd.fd);
+
+	/* Stream a lot of values through the (much smaller) queue of a file. */
+	stream_fd = open(DEV_PATH, O_RDWR);
+	assert (stream_fd != -1);
+	rc = ioctl(stream_fd, RA_IOC_SET_OP, RA_OP_ENCRYPT);
+	assert (rc == 0);
+	stream = malloc(STREAM_LEN * sizeof(int));
+	assert (stream != NULL);
+	if (pthread_create(&writer_thread, NULL, writer_stream, &stream_fd)) {
+		fprintf(stderr, "create() error !\n");
+		return -1;
+	}
+	rc = read(stream_fd, stream, STREAM_LEN * sizeof(int));
+	assert (rc == STREAM_LEN * sizeof(int));
+	for (i = 0; i < STREAM_LEN; ++i) {
+		assert (stream[i] == i + i % THR + 1);
+	}
+	if(pthread_join(writer_thread, NULL)) {
+		fprintf(stderr, "join() error !\n");
+		return -2;
+	}
+	close(stream_fd);
+
+	/* The pool gives the same results as a single device. */
+	stream_fd = open(POOL_PATH, O_RDWR);
+	assert (stream_fd != -1);
+	rc = ioctl(stream_fd, RA_IOC_SET_OP, RA_OP_ENCRYPT);
+	assert (rc == 0);
+	for (i = 0; i < POOL_LEN; ++i) {
+		stream[i] = i;
+	}
+	rc = write(stream_fd, stream, POOL_LEN * sizeof(int));
+	assert (rc == POOL_LEN * sizeof(int));
+	rc = read(stream_fd, stream, POOL_LEN * sizeof(int));
+	assert (rc == POOL_LEN * sizeof(int));
+	for (i = 0; i < POOL_LEN; ++i) {
+		assert (stream[i] == i + i % THR + 1);
+	}
+	close(stream_fd);
+
+	/* So does the crypto API, if the kernel has it. */
+	for (i = 0; i < POOL_LEN; ++i) {
+		stream[i] = i;
+	}
+	if (crypto_af_alg(stream, POOL_LEN, RA_OP_ENCRYPT, ALG_POS) == 0) {
+		for (i = 0; i < POOL_LEN; ++i) {
+			assert (stream[i] == i + (i + ALG_POS) % THR + 1);
+		}
+		rc = crypto_af_alg(stream, POOL_LEN, RA_OP_DECRYPT, ALG_POS);
+		assert (rc == 0);
+		for (i = 0; i < POOL_LEN; ++i) {
+			assert (stream[i] == i);
+		}
+	} else {
+		fprintf(stderr, "No AF_ALG or no crypto engine, skipped.\n");
+	}
+
+	/* Pipe -> device -> pipe, through splice(). */
+	rc = pipe(pipe_in);
+	assert (rc == 0);
+	rc = pipe(pipe_out);
+	assert (rc == 0);
+	stream_fd = open(DEV_PATH, O_RDWR);
+	assert (stream_fd != -1);
+	rc = ioctl(stream_fd, RA_IOC_SET_OP, RA_OP_ENCRYPT);
+	assert (rc == 0);
+	for (i = 0; i < SPLICE_LEN; ++i) {
+		stream[i] = i;
+	}
+	rc = write(pipe_in[1], stream, SPLICE_LEN * sizeof(int));
+	assert (rc == SPLICE_LEN * sizeof(int));
+	rc = splice(pipe_in[0], NULL, stream_fd, NULL,
+		    SPLICE_LEN * sizeof(int), 0);
+	assert (rc == SPLICE_LEN * sizeof(int));
+	rc = splice(stream_fd, NULL, pipe_out[1], NULL,
+		    SPLICE_LEN * sizeof(int), 0);
+	assert (rc == SPLICE_LEN * sizeof(int));
+	rc = read(pipe_out[0], stream, SPLICE_LEN * sizeof(int));
+	assert (rc == SPLICE_LEN * sizeof(int));
+	for (i = 0; i < SPLICE_LEN; ++i) {
+		assert (stream[i] == i + i % THR + 1);
+	}
+	close(stream_fd);
+	for (i = 0; i < 2; ++i) {
+		close(pipe_in[i]);
+		close(pipe_out[i]);
+	}
+	free(stream);
+
 	fprintf(stderr, "\nAll checks are OK !\n");
 
 	return 0;